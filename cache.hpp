@@ -0,0 +1,346 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <mutex>
+#include <memory>
+#include <algorithm>
+#include <iterator>
+#include <atomic>
+#include <functional>
+#include <cstdint>
+
+namespace ns_util
+{
+    //Count-Min Sketch：用很少的内存近似统计每个key最近的访问次数，计数上限为15
+    //总的计数次数达到一定值之后所有计数减半，让过去的热点逐渐冷却
+    class CountMinSketch
+    {
+    private:
+        static const int DEPTH = 4;
+        static const uint8_t MAX_COUNT = 15;
+
+        std::vector<uint8_t> table;//DEPTH行，每行width个计数
+        size_t width;//2的幂
+        size_t additions;
+        size_t reset_threshold;
+    public:
+        explicit CountMinSketch(size_t expected_entries)
+            :width(64), additions(0)
+        {
+            while(width < expected_entries)
+            {
+                width <<= 1;
+            }
+            table.assign(width * DEPTH, 0);
+            reset_threshold = width * 10;
+        }
+
+        void Increment(size_t hash)
+        {
+            bool added = false;
+            for(int i = 0; i < DEPTH; ++i)
+            {
+                uint8_t& counter = table[i * width + Index(hash, i)];
+                if(counter < MAX_COUNT)
+                {
+                    ++counter;
+                    added = true;
+                }
+            }
+            if(added && ++additions >= reset_threshold)
+            {
+                for(uint8_t& counter : table)
+                {
+                    counter >>= 1;
+                }
+                additions /= 2;
+            }
+        }
+
+        uint8_t Frequency(size_t hash) const
+        {
+            uint8_t frequency = MAX_COUNT;
+            for(int i = 0; i < DEPTH; ++i)
+            {
+                frequency = std::min(frequency, table[i * width + Index(hash, i)]);
+            }
+            return frequency;
+        }
+    private:
+        size_t Index(size_t hash, int i) const
+        {
+            uint64_t h = (hash + i) * 0x9E3779B97F4A7C15ULL;
+            return (h ^ (h >> 32)) & (width - 1);
+        }
+    };
+
+    //缓存的统计信息
+    struct CacheStats
+    {
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t rejected;//TinyLFU没有准入的新条目
+        uint64_t evictions;
+        uint64_t entries;
+        uint64_t bytes;
+
+        CacheStats()
+            :hits(0), misses(0), rejected(0), evictions(0), entries(0), bytes(0)
+        {}
+    };
+
+    //分片的W-TinyLFU缓存，key和value都是字符串，按字节数限制内存：
+    //新条目先进入占1%容量的窗口LRU，被挤出窗口时与主区(SLRU：probation + protected)中最久未访问的条目比较访问频率，
+    //频率更高的留下，偶发的查询不会把热点挤出缓存
+    //每个条目带有版本号，只有版本号一致时才命中；出现更新的版本时清空缓存，旧版本的条目不再写入
+    class TinyLfuCache
+    {
+    private:
+        static const size_t SHARD_COUNT = 16;
+        static const size_t ENTRY_OVERHEAD = 128;//每个条目在key和value之外的内存开销估计
+
+        enum Region
+        {
+            WINDOW,
+            PROBATION,
+            PROTECTED
+        };
+
+        struct Entry
+        {
+            std::string key;
+            std::string value;
+            uint64_t version;
+            size_t charge;//占用的字节数
+            Region region;
+        };
+        typedef std::list<Entry> EntryList;
+
+        struct Shard
+        {
+            std::mutex mtx;
+            std::unordered_map<std::string, EntryList::iterator> table;
+            EntryList lists[3];//按Region下标，表头是最近访问的
+            size_t bytes[3];
+            size_t window_capacity;
+            size_t main_capacity;
+            size_t protected_capacity;
+            CountMinSketch sketch;
+            CacheStats stats;
+
+            explicit Shard(size_t capacity)
+                :window_capacity(capacity / 100), main_capacity(capacity - capacity / 100),
+                 protected_capacity((capacity - capacity / 100) * 4 / 5), sketch(std::max<size_t>(64, capacity / 1024))
+            {
+                bytes[WINDOW] = bytes[PROBATION] = bytes[PROTECTED] = 0;
+            }
+        };
+
+        std::vector<std::unique_ptr<Shard> > shards;
+        std::atomic<uint64_t> latest_version;//见过的最新版本号
+    public:
+        //capacity: 总的内存预算(字节)，为0时不缓存
+        explicit TinyLfuCache(size_t capacity)
+            :latest_version(0)
+        {
+            if(capacity == 0)
+            {
+                return;
+            }
+            for(size_t i = 0; i < SHARD_COUNT; ++i)
+            {
+                shards.emplace_back(new Shard(capacity / SHARD_COUNT));
+            }
+        }
+        TinyLfuCache(const TinyLfuCache&) = delete;
+        TinyLfuCache& operator=(const TinyLfuCache&) = delete;
+
+        bool Get(const std::string& key, uint64_t version, std::string* value)
+        {
+            if(shards.empty())
+            {
+                return false;
+            }
+            ObserveVersion(version);
+            size_t hash = std::hash<std::string>()(key);
+            Shard& shard = *shards[hash % SHARD_COUNT];
+            std::lock_guard<std::mutex> lock(shard.mtx);
+            shard.sketch.Increment(hash);
+            auto iter = shard.table.find(key);
+            if(iter == shard.table.end() || iter->second->version != version)
+            {
+                ++shard.stats.misses;
+                return false;
+            }
+            ++shard.stats.hits;
+            *value = iter->second->value;
+            Touch(&shard, iter->second);
+            return true;
+        }
+
+        void Put(const std::string& key, uint64_t version, const std::string& value)
+        {
+            if(shards.empty())
+            {
+                return;
+            }
+            ObserveVersion(version);
+            if(version < latest_version)
+            {
+                return;//已经有更新的索引，这个结果过时了
+            }
+            size_t hash = std::hash<std::string>()(key);
+            Shard& shard = *shards[hash % SHARD_COUNT];
+            size_t charge = key.size() + value.size() + ENTRY_OVERHEAD;
+            if(charge > shard.main_capacity / 8)
+            {
+                return;//太大的结果不缓存
+            }
+            std::lock_guard<std::mutex> lock(shard.mtx);
+            auto iter = shard.table.find(key);
+            if(iter != shard.table.end())
+            {
+                Entry& entry = *iter->second;
+                shard.bytes[entry.region] += charge - entry.charge;
+                entry.value = value;
+                entry.version = version;
+                entry.charge = charge;
+                Touch(&shard, iter->second);
+            }
+            else
+            {
+                EntryList& window = shard.lists[WINDOW];
+                window.push_front(Entry());
+                Entry& entry = window.front();
+                entry.key = key;
+                entry.value = value;
+                entry.version = version;
+                entry.charge = charge;
+                entry.region = WINDOW;
+                shard.bytes[WINDOW] += charge;
+                shard.table[key] = window.begin();
+            }
+            Evict(&shard);
+        }
+
+        //清空全部条目，统计信息保留
+        void Clear()
+        {
+            for(auto& shard : shards)
+            {
+                std::lock_guard<std::mutex> lock(shard->mtx);
+                shard->table.clear();
+                for(int region = WINDOW; region <= PROTECTED; ++region)
+                {
+                    shard->lists[region].clear();
+                    shard->bytes[region] = 0;
+                }
+            }
+        }
+
+        CacheStats GetStats()
+        {
+            CacheStats total;
+            for(auto& shard : shards)
+            {
+                std::lock_guard<std::mutex> lock(shard->mtx);
+                total.hits += shard->stats.hits;
+                total.misses += shard->stats.misses;
+                total.rejected += shard->stats.rejected;
+                total.evictions += shard->stats.evictions;
+                total.entries += shard->table.size();
+                total.bytes += shard->bytes[WINDOW] + shard->bytes[PROBATION] + shard->bytes[PROTECTED];
+            }
+            return total;
+        }
+    private:
+        //出现更新的版本时清空缓存，只有一个线程执行清空
+        void ObserveVersion(uint64_t version)
+        {
+            uint64_t latest = latest_version.load();
+            while(version > latest)
+            {
+                if(latest_version.compare_exchange_weak(latest, version))
+                {
+                    Clear();
+                    return;
+                }
+            }
+        }
+
+        //命中时调整位置：窗口和protected中移到表头，probation中的升级到protected
+        static void Touch(Shard* shard, EntryList::iterator iter)
+        {
+            Entry& entry = *iter;
+            if(entry.region != PROBATION)
+            {
+                EntryList& list = shard->lists[entry.region];
+                list.splice(list.begin(), list, iter);
+                return;
+            }
+            Move(shard, iter, PROTECTED);
+            //protected超出容量时把最久未访问的降级到probation
+            while(shard->bytes[PROTECTED] > shard->protected_capacity && shard->lists[PROTECTED].size() > 1)
+            {
+                Move(shard, std::prev(shard->lists[PROTECTED].end()), PROBATION);
+            }
+        }
+
+        static void Move(Shard* shard, EntryList::iterator iter, Region to)
+        {
+            Entry& entry = *iter;
+            shard->bytes[entry.region] -= entry.charge;
+            shard->bytes[to] += entry.charge;
+            shard->lists[to].splice(shard->lists[to].begin(), shard->lists[entry.region], iter);
+            entry.region = to;
+        }
+
+        static void Remove(Shard* shard, EntryList::iterator iter)
+        {
+            Entry& entry = *iter;
+            shard->bytes[entry.region] -= entry.charge;
+            shard->table.erase(entry.key);
+            shard->lists[entry.region].erase(iter);
+        }
+
+        //窗口超出容量时，被挤出的条目进入probation，主区超出容量时与主区最久未访问的条目比较频率，淘汰频率低的
+        static void Evict(Shard* shard)
+        {
+            while(shard->bytes[WINDOW] > shard->window_capacity && !shard->lists[WINDOW].empty())
+            {
+                EntryList::iterator candidate = std::prev(shard->lists[WINDOW].end());
+                Move(shard, candidate, PROBATION);
+                while(shard->bytes[PROBATION] + shard->bytes[PROTECTED] > shard->main_capacity)
+                {
+                    EntryList::iterator victim = std::prev(shard->lists[PROBATION].end());
+                    if(victim == candidate && !shard->lists[PROTECTED].empty())
+                    {
+                        victim = std::prev(shard->lists[PROTECTED].end());
+                    }
+                    if(victim == candidate)
+                    {
+                        Remove(shard, candidate);
+                        ++shard->stats.rejected;
+                        break;
+                    }
+                    size_t candidate_hash = std::hash<std::string>()(candidate->key);
+                    size_t victim_hash = std::hash<std::string>()(victim->key);
+                    if(shard->sketch.Frequency(candidate_hash) > shard->sketch.Frequency(victim_hash))
+                    {
+                        Remove(shard, victim);
+                        ++shard->stats.evictions;
+                    }
+                    else
+                    {
+                        Remove(shard, candidate);
+                        ++shard->stats.rejected;
+                        break;
+                    }
+                }
+            }
+        }
+    };
+}
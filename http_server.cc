@@ -2,12 +2,46 @@
 #include "httplib.h"
 
 const std::string input = "data/raw_html/raw.txt";
+const std::string index_file = "data/raw_html/index.bin";
 const std::string root_path = "./wwwroot";
+//每页最多返回的结果个数
+const size_t max_count = 50;
+//检查索引文件是否被替换的间隔(秒)
+const int watch_interval = 5;
+//增量添加的文档刷成段的间隔(秒)，也就是新文档最长多久之后可以被搜索到
+const int flush_interval = 1;
+//查询结果缓存的内存预算(字节)，为0时不缓存
+const size_t cache_bytes = 64 << 20;
+//启动时预先解码并常驻内存的高频词个数
+const size_t pinned_terms = 64;
+
+//解析非负整数参数
+static bool ParseSize(const std::string& value, size_t* out)
+{
+    if(value.empty() || value.size() > 9 || value.find_first_not_of("0123456789") != std::string::npos)
+    {
+        return false;
+    }
+    *out = std::stoul(value);
+    return true;
+}
+
+//管理接口只允许本机访问
+static bool CheckLocal(const httplib::Request& req, httplib::Response& resp)
+{
+    if(req.remote_addr != "127.0.0.1" && req.remote_addr != "::1")
+    {
+        resp.status = 403;
+        resp.set_content("只允许本机访问!", "text/plain; charset=utf-8");
+        return false;
+    }
+    return true;
+}
 
 int main()
 {
-    ns_searcher::Searcher search;
-    search.InitSearcher(input);
+    ns_searcher::Searcher search(cache_bytes, pinned_terms);
+    search.InitSearcher(index_file, input);
 
     httplib::Server svr;
     svr.set_base_dir(root_path.c_str());
@@ -20,10 +54,136 @@ int main()
         }
         std::string word = req.get_param_value("word");
         LOG(NORMAL, "用户搜索的: " + word);
+
+        //分页参数：start/count按偏移分页，cursor为上一页返回的游标
+        ns_searcher::SearchOptions options;
+        if(req.has_param("count") && (!ParseSize(req.get_param_value("count"), &options.count) ||
+                                      options.count == 0 || options.count > max_count))
+        {
+            resp.set_content("count必须在1到" + std::to_string(max_count) + "之间!", "text/plain; charset=utf-8");
+            return;
+        }
+        if(req.has_param("cursor"))
+        {
+            if(!ns_searcher::Searcher::ParseCursor(req.get_param_value("cursor"), &options))
+            {
+                resp.set_content("cursor无效!", "text/plain; charset=utf-8");
+                return;
+            }
+        }
+        else if(req.has_param("start") && !ParseSize(req.get_param_value("start"), &options.start))
+        {
+            resp.set_content("start必须是非负整数!", "text/plain; charset=utf-8");
+            return;
+        }
+
+        options.exact_total = req.has_param("exact_total");
+
+        //打分方式：默认按title/content词频加权，rank=bm25时使用BM25F
+        if(req.has_param("rank"))
+        {
+            std::string rank = req.get_param_value("rank");
+            if(rank == "bm25")
+            {
+                options.rank = ns_searcher::RANK_BM25;
+            }
+            else if(rank != "weight")
+            {
+                resp.set_content("rank只能是weight或bm25!", "text/plain; charset=utf-8");
+                return;
+            }
+        }
+
         std::string json_string;
-        search.Search(word, &json_string);
+        search.Search(word, &json_string, options);
         resp.set_content(json_string, "application/json");
     });
+    //管理接口：后台重新建立索引，完成后整体替换当前索引，正在进行的查询不受影响；只允许本机访问
+    svr.Post("/admin/reload", [&search](const httplib::Request& req, httplib::Response& resp)
+    {
+        if(!CheckLocal(req, resp))
+        {
+            return;
+        }
+        if(!search.StartRebuild())
+        {
+            resp.status = 409;
+            resp.set_content("正在重新建立索引，请稍后再试!", "text/plain; charset=utf-8");
+            return;
+        }
+        resp.status = 202;
+        resp.set_content("开始重新建立索引...", "text/plain; charset=utf-8");
+    });
+
+    //增量添加或更新文档：body为json {"title": ..., "content": ..., "url": ...}，url已经存在时作为更新
+    svr.Post("/admin/doc", [&search](const httplib::Request& req, httplib::Response& resp)
+    {
+        if(!CheckLocal(req, resp))
+        {
+            return;
+        }
+        Json::Value doc;
+        Json::Reader reader;
+        if(!reader.parse(req.body, doc) || !doc.isObject() || !doc["title"].isString() ||
+           !doc["content"].isString() || !doc["url"].isString() ||
+           !search.AddDocument(doc["title"].asString(), doc["content"].asString(), doc["url"].asString()))
+        {
+            resp.status = 400;
+            resp.set_content("文档格式错误!", "text/plain; charset=utf-8");
+            return;
+        }
+        resp.status = 202;
+        resp.set_content("文档已添加，稍后可以被搜索到", "text/plain; charset=utf-8");
+    });
+
+    //增量删除文档：/admin/doc?url=...
+    svr.Delete("/admin/doc", [&search](const httplib::Request& req, httplib::Response& resp)
+    {
+        if(!CheckLocal(req, resp))
+        {
+            return;
+        }
+        if(!req.has_param("url") || !search.DeleteDocument(req.get_param_value("url")))
+        {
+            resp.status = 404;
+            resp.set_content("文档不存在!", "text/plain; charset=utf-8");
+            return;
+        }
+        resp.set_content("文档已删除", "text/plain; charset=utf-8");
+    });
+
+    //索引各个段的状态和后台合并的统计信息
+    svr.Get("/admin/stats", [&search](const httplib::Request& req, httplib::Response& resp)
+    {
+        if(!CheckLocal(req, resp))
+        {
+            return;
+        }
+        std::string json_string;
+        search.GetStats(&json_string);
+        resp.set_content(json_string, "application/json");
+    });
+
+    //定期把增量添加的文档刷成段
+    std::thread([&search]()
+    {
+        while(true)
+        {
+            std::this_thread::sleep_for(std::chrono::seconds(flush_interval));
+            search.Flush();
+        }
+    }).detach();
+
+    //indexer重新生成索引文件之后自动加载
+    std::thread([&search]()
+    {
+        while(true)
+        {
+            std::this_thread::sleep_for(std::chrono::seconds(watch_interval));
+            search.ReloadIfChanged();
+        }
+    }).detach();
+
     LOG(NORMAL, "服务器启动成功...");
     //服务默认绑定8080端口
     svr.listen("0.0.0.0", 8080);
@@ -6,139 +6,836 @@
 #include <unordered_map>
 #include <fstream>
 #include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <memory>
+#include <map>
+#include <atomic>
+#include <algorithm>
+#include <cstring>
+#include <cmath>
+#include <boost/utility/string_view.hpp>
 #include "util.hpp"
 #include "log.hpp"
+#include "cppjieba/limonp/BlockingQueue.hpp"
+#include "cppjieba/limonp/BoundedBlockingQueue.hpp"
 
 namespace ns_index
 {
+    //正排文档，title/content/url直接指向索引镜像，不拷贝
     struct DocInfo
     {
-        std::string title;
-        std::string content;
-        std::string url;
+        boost::string_view title;
+        boost::string_view content;
+        boost::string_view url;
         uint64_t doc_id;
     };
 
-    struct InvertedElem
+    //索引文件格式：魔数 + 版本号，格式发生变化时需要递增版本号
+    const uint32_t INDEX_MAGIC = 0x58495342; // "BSIX"
+    const uint32_t INDEX_VERSION = 10;
+
+    //倒排拉链按块压缩，每块BLOCK_SIZE个倒排元素
+    const uint32_t BLOCK_SIZE = 128;
+
+    //倒排元素个数不少于IMPACT_MIN_DF的高频词，额外保存按分数降序排列的前IMPACT_TOP_N个倒排元素(impact列表)，
+    //单个词的查询从头读到不可能再进入前k个结果为止，不需要遍历整个倒排拉链
+    const uint32_t IMPACT_MIN_DF = 2 * BLOCK_SIZE;
+    const uint32_t IMPACT_TOP_N = 4 * BLOCK_SIZE;
+
+    //impact列表的排序方式，与打分方式对应
+    enum ImpactOrder
     {
-        uint64_t doc_id;
-        std::string word;
-        int weight;
+        IMPACT_WEIGHT,
+        IMPACT_BM25,
+        IMPACT_ORDER_COUNT
     };
 
-    //倒排拉链
-    typedef std::vector<InvertedElem> InvertedList;
+    //默认打分：title和content中出现的词所占的权重
+    const uint32_t TITLE_WEIGHT = 10;
+    const uint32_t CONTENT_WEIGHT = 1;
 
-    class Index
+    inline uint32_t TermWeight(uint32_t title_tf, uint32_t content_tf)
+    {
+        return title_tf * TITLE_WEIGHT + content_tf * CONTENT_WEIGHT;
+    }
+
+    //BM25F打分参数，建立索引时按照这组参数计算每个词、每个块的分数上界
+    const double BM25_K1 = 1.2;
+    const double BM25_TITLE_BOOST = 5.0;
+    const double BM25_CONTENT_BOOST = 1.0;
+    const double BM25_TITLE_B = 0.5;
+    const double BM25_CONTENT_B = 0.75;
+
+    inline double Bm25Idf(uint64_t doc_count, uint64_t doc_freq)
+    {
+        return std::log(1.0 + (doc_count - doc_freq + 0.5) / (doc_freq + 0.5));
+    }
+
+    //某个字段的长度归一化因子：(1 - b) + b * 字段长度 / 平均长度
+    inline double Bm25Norm(double b, uint32_t length, double avg_length)
+    {
+        return avg_length > 0 ? (1 - b) + b * length / avg_length : 1.0;
+    }
+
+    //BM25F：先把各字段的词频按权重和长度归一化后合并，再做一次饱和，结果在[0, 1)之间，乘以idf即为分数
+    inline double Bm25Tf(uint32_t title_tf, uint32_t content_tf, double title_norm, double content_norm)
+    {
+        double tf = BM25_TITLE_BOOST * title_tf / title_norm + BM25_CONTENT_BOOST * content_tf / content_norm;
+        return tf / (BM25_K1 + tf);
+    }
+
+    //平均长度由local_avg换成avg之后，同一个文档的长度归一化因子至少变为原来的多少倍
+    //(1 - b) + b * len / avg = (1 - b) + b * len / local_avg * (local_avg / avg)，所以不小于原来的min(1, local_avg / avg)倍
+    inline double Bm25NormFloor(double b, double local_avg, double avg)
+    {
+        if(avg <= 0)
+        {
+            return 1;//未删除的文档长度都是0，归一化因子为1，不小于原来的(1 - b)
+        }
+        if(local_avg <= 0)
+        {
+            return 1 - b;//原来的归一化因子都是1
+        }
+        return std::min(1.0, local_avg / avg);
+    }
+
+    //BM25F长度归一化使用的各字段平均长度：查询时按整个快照中未删除的文档统计，各个段的分数可以直接比较
+    struct Bm25Averages
+    {
+        double title;
+        double content;
+
+        Bm25Averages()
+            :title(0), content(0)
+        {}
+    };
+
+    //分数上界以float保存，向上取整保证不小于实际分数
+    inline float RoundUp(double value)
+    {
+        float f = static_cast<float>(value);
+        return f < value ? std::nextafter(f, INFINITY) : f;
+    }
+
+    //索引镜像布局(各段按8字节对齐)，可以直接mmap之后使用：
+    //IndexHeader | DocRecord[doc_count] | TermRecord[term_count](按word字节序排序，下标即term_id) | TermSlot[term_slot_count]
+    //| BlockRecord[block_count] | 倒排压缩数据 | impact列表 | 字符串区
+    struct IndexHeader
+    {
+        uint32_t magic;
+        uint32_t version;
+        uint64_t doc_count;
+        uint64_t title_tokens;//所有文档title的分词个数之和，用于计算平均长度
+        uint64_t content_tokens;
+        uint64_t term_count;
+        uint64_t posting_count;
+        uint64_t block_count;
+        uint64_t docs_offset;
+        uint64_t terms_offset;
+        uint64_t term_slots_offset;
+        uint64_t term_slot_count;//词典哈希表的大小，为2的幂
+        uint64_t blocks_offset;
+        uint64_t postings_offset;
+        uint64_t postings_size;
+        uint64_t impacts_offset;
+        uint64_t impacts_size;
+        uint64_t strings_offset;
+        uint64_t strings_size;
+        //建立索引时raw.txt的状态和内容的哈希，服务启动时据此判断索引文件是否过期
+        uint64_t source_inode;
+        uint64_t source_size;
+        uint64_t source_mtime;
+        uint64_t source_mtime_nsec;
+        uint64_t source_hash;
+    };
+
+    //字符串均以(字符串区内偏移, 长度)的形式保存
+    struct DocRecord
+    {
+        uint64_t title_offset;
+        uint64_t content_offset;
+        uint64_t url_offset;
+        uint32_t title_size;
+        uint32_t content_size;
+        uint32_t url_size;
+        uint32_t title_length;//title的分词个数，BM25F的长度归一化因子在查询时根据它计算
+        uint32_t content_length;
+        uint32_t reserved;
+    };
+
+    struct TermRecord
+    {
+        uint64_t word_offset;
+        uint32_t word_size;
+        uint32_t doc_freq;//倒排元素个数
+        uint64_t block_begin;//在BlockRecord[]中的下标，块数为ceil(doc_freq / BLOCK_SIZE)
+        uint32_t max_weight;//整个倒排拉链中最大的weight，用于WAND剪枝
+        float max_bm25;//整个倒排拉链中最大的BM25词频饱和值(Bm25Tf)，按段内的平均长度计算，不含idf
+        uint64_t impact_offset;//在impact列表区中的偏移，先是按weight排序的，再是按BM25排序的
+        uint32_t impact_count;//每种排序保存的倒排元素个数，为0表示没有impact列表
+        uint32_t impact_bm25_offset;//按BM25排序的部分相对impact_offset的偏移
+    };
+
+    //词典的哈希表：开放寻址(线性探测)，查找时先比较哈希值，相同才比较字符串
+    struct TermSlot
+    {
+        uint32_t hash;
+        uint32_t term;//term_id + 1，0表示空位
+    };
+
+    inline uint32_t TermHash(boost::string_view word)
+    {
+        uint64_t hash = ns_util::HashUtil::Fnv1a(word);
+        return static_cast<uint32_t>(hash ^ (hash >> 32));
+    }
+
+    //哈希表的大小：不小于词数两倍的2的幂，装载率不超过一半
+    inline uint64_t TermSlotCount(uint64_t term_count)
+    {
+        uint64_t count = 2;
+        while(count < term_count * 2)
+        {
+            count <<= 1;
+        }
+        return count;
+    }
+
+    //建立索引时的词典：每个词对应一个稠密的term_id，所有词的字节连续保存在一块内存(arena)中，
+    //哈希表只保存term_id，扩容时不需要移动字符串
+    class TermDictionary
     {
     private:
-        std::vector<DocInfo> forward_index;//正排索引
-        std::unordered_map<std::string, InvertedList> inverted_index;//倒排索引
+        std::string arena;
+        std::vector<uint64_t> offsets;//第i个词为arena[offsets[i], offsets[i + 1])
+        std::vector<uint32_t> hashes;//每个词的TermHash
+        std::vector<TermSlot> slots;
+    public:
+        TermDictionary()
+            :offsets(1, 0)
+        {}
+
+        size_t size() const { return hashes.size(); }
+
+        boost::string_view Term(uint32_t term_id) const
+        {
+            return boost::string_view(arena.data() + offsets[term_id], offsets[term_id + 1] - offsets[term_id]);
+        }
+
+        bool Find(boost::string_view word, uint32_t* term_id) const
+        {
+            if(slots.empty())
+            {
+                return false;
+            }
+            const uint32_t hash = TermHash(word);
+            const size_t mask = slots.size() - 1;
+            for(size_t i = hash & mask; slots[i].term != 0; i = (i + 1) & mask)
+            {
+                if(slots[i].hash == hash && Term(slots[i].term - 1) == word)
+                {
+                    *term_id = slots[i].term - 1;
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        //返回word的term_id，第一次出现时分配新的term_id
+        uint32_t Intern(boost::string_view word)
+        {
+            uint32_t term_id = 0;
+            if(Find(word, &term_id))
+            {
+                return term_id;
+            }
+            term_id = static_cast<uint32_t>(size());
+            arena.append(word.data(), word.size());
+            offsets.push_back(arena.size());
+            hashes.push_back(TermHash(word));
+            if((size() + 1) * 2 > slots.size())
+            {
+                Rehash(TermSlotCount(size() + 1));
+            }
+            else
+            {
+                Place(term_id);
+            }
+            return term_id;
+        }
+
+        void Clear()
+        {
+            arena.clear();
+            offsets.assign(1, 0);
+            hashes.clear();
+            slots.clear();
+        }
     private:
-        //设计为单例模式
-        static Index* instance;
-        static std::mutex mtx;
+        void Place(uint32_t term_id)
+        {
+            const size_t mask = slots.size() - 1;
+            size_t i = hashes[term_id] & mask;
+            while(slots[i].term != 0)
+            {
+                i = (i + 1) & mask;
+            }
+            slots[i].hash = hashes[term_id];
+            slots[i].term = term_id + 1;
+        }
+
+        void Rehash(size_t capacity)
+        {
+            TermSlot empty;
+            empty.hash = 0;
+            empty.term = 0;
+            slots.assign(capacity, empty);
+            for(uint32_t term_id = 0; term_id < size(); ++term_id)
+            {
+                Place(term_id);
+            }
+        }
+    };
+
+    //impact列表中的一个倒排元素，列表按分数降序排列，分数相同时doc_id小的在前
+    //保存为doc_id、title词频、content词频三个varint
+    struct ImpactEntry
+    {
+        uint32_t doc_id;
+        uint32_t title_tf;
+        uint32_t content_tf;
+    };
+    typedef std::vector<ImpactEntry> ImpactList;
+
+    //常驻内存的词预先解码好的整个倒排拉链
+    struct DecodedPostings
+    {
+        std::vector<uint32_t> doc_ids;
+        std::vector<uint32_t> title_tfs;
+        std::vector<uint32_t> content_tfs;
+    };
+
+    //跳表项：块内数据先是doc_id的差值(相对前一个doc_id，第一个块相对0)，再是title词频、content词频，均为varint
+    struct BlockRecord
+    {
+        uint64_t offset;//在倒排压缩数据中的偏移
+        uint32_t last_doc_id;//块内最大的doc_id，用于跳过整块
+        uint32_t max_weight;//块内最大的weight，用于Block-Max WAND剪枝
+        float max_bm25;//块内最大的BM25词频饱和值，与TermRecord::max_bm25相同
+        uint32_t reserved;
+    };
+
+    //倒排拉链，指向索引镜像中某个词的压缩块，word只在词典中保存一份
+    class InvertedList
+    {
     private:
-        Index(){}
-        Index(const Index&) = delete;
-        Index& operator=(const Index&) = delete;
+        const BlockRecord* blocks_;
+        const uint8_t* data_;
+        const DecodedPostings* decoded_;//常驻内存的词不为空，解码时直接复制
+        uint32_t size_;
+        uint32_t max_weight_;
+        float max_bm25_;
     public:
-        ~Index(){}
+        InvertedList()
+            :blocks_(nullptr), data_(nullptr), decoded_(nullptr), size_(0), max_weight_(0), max_bm25_(0)
+        {}
+        InvertedList(const BlockRecord* blocks, const uint8_t* data, const TermRecord& term,
+                     const DecodedPostings* decoded = nullptr)
+            :blocks_(blocks), data_(data), decoded_(decoded), size_(term.doc_freq), max_weight_(term.max_weight),
+             max_bm25_(term.max_bm25)
+        {}
+
+        const BlockRecord* Blocks() const { return blocks_; }
+        const uint8_t* Data() const { return data_; }
+        const DecodedPostings* Decoded() const { return decoded_; }
+        uint32_t MaxWeight() const { return max_weight_; }
+        float MaxBm25() const { return max_bm25_; }
+        uint32_t BlockCount() const { return (size_ + BLOCK_SIZE - 1) / BLOCK_SIZE; }
+        size_t size() const { return size_; }
+        bool empty() const { return size_ == 0; }
+    };
+
+    //倒排拉链的解码游标，按块解码，借助跳表项跳过不需要的块
+    class PostingIterator
+    {
+    private:
+        InvertedList list;
+        uint32_t block;//当前解码的块
+        uint32_t block_len;
+        uint32_t pos;//块内位置
+        uint32_t doc_ids[BLOCK_SIZE];
+        uint32_t title_tfs[BLOCK_SIZE];
+        uint32_t content_tfs[BLOCK_SIZE];
     public:
-        static Index* GetInstance()
+        explicit PostingIterator(const InvertedList& inverted_list)
+            :list(inverted_list), block(0), block_len(0), pos(0)
+        {
+            if(!list.empty())
+            {
+                DecodeBlock(0);
+            }
+        }
+
+        bool End() const { return pos >= block_len; }
+        uint32_t DocId() const { return doc_ids[pos]; }
+        uint32_t TitleTf() const { return title_tfs[pos]; }
+        uint32_t ContentTf() const { return content_tfs[pos]; }
+        uint32_t Weight() const { return TermWeight(title_tfs[pos], content_tfs[pos]); }
+        const InvertedList& List() const { return list; }
+
+        //按块遍历：当前块完整的doc_id/词频数组，与NextBlock配合使用，省去逐个元素的判断
+        const uint32_t* BlockDocIds() const { return doc_ids; }
+        const uint32_t* BlockTitleTfs() const { return title_tfs; }
+        const uint32_t* BlockContentTfs() const { return content_tfs; }
+        uint32_t BlockLength() const { return block_len; }
+
+        void NextBlock()
+        {
+            if(block + 1 < list.BlockCount())
+            {
+                DecodeBlock(block + 1);
+            }
+            else
+            {
+                pos = block_len;
+            }
+        }
+
+        //从当前块开始查找第一个last_doc_id >= target的块，只查跳表不解码，找不到时返回BlockCount()
+        uint32_t FindBlock(uint32_t target) const
+        {
+            const BlockRecord* begin = list.Blocks() + block;
+            const BlockRecord* end = list.Blocks() + list.BlockCount();
+            const BlockRecord* iter = std::lower_bound(begin, end, target,
+                    [](const BlockRecord& record, uint32_t key){return record.last_doc_id < key;});
+            return static_cast<uint32_t>(iter - list.Blocks());
+        }
+
+        void Next()
+        {
+            if(++pos == block_len && block + 1 < list.BlockCount())
+            {
+                DecodeBlock(block + 1);
+            }
+        }
+
+        //移动到第一个doc_id >= target的位置
+        void Advance(uint32_t target)
         {
-            if(nullptr == instance)
+            if(End() || doc_ids[pos] >= target)
+            {
+                return;
+            }
+            if(doc_ids[block_len - 1] < target)
             {
-                mtx.lock();
-                if(nullptr == instance)
+                //借助跳表项找到可能包含target的块
+                uint32_t b = FindBlock(target);
+                if(b == list.BlockCount())
                 {
-                    instance = new Index();
+                    pos = block_len;
+                    return;
                 }
-                mtx.unlock();
+                DecodeBlock(b);
+            }
+            while(doc_ids[pos] < target)
+            {
+                ++pos;
+            }
+        }
+    private:
+        void DecodeBlock(uint32_t b)
+        {
+            block = b;
+            pos = 0;
+            block_len = std::min<uint32_t>(BLOCK_SIZE, list.size() - b * BLOCK_SIZE);
+            if(list.Decoded() != nullptr)
+            {
+                const size_t begin = static_cast<size_t>(b) * BLOCK_SIZE;
+                std::memcpy(doc_ids, &list.Decoded()->doc_ids[begin], sizeof(uint32_t) * block_len);
+                std::memcpy(title_tfs, &list.Decoded()->title_tfs[begin], sizeof(uint32_t) * block_len);
+                std::memcpy(content_tfs, &list.Decoded()->content_tfs[begin], sizeof(uint32_t) * block_len);
+                return;
+            }
+            const uint8_t* p = list.Data() + list.Blocks()[b].offset;
+            uint32_t doc_id = b == 0 ? 0 : list.Blocks()[b - 1].last_doc_id;
+            for(uint32_t i = 0; i < block_len; ++i)
+            {
+                doc_id += ns_util::VarintUtil::Decode(&p);
+                doc_ids[i] = doc_id;
+            }
+            for(uint32_t i = 0; i < block_len; ++i)
+            {
+                title_tfs[i] = ns_util::VarintUtil::Decode(&p);
+            }
+            for(uint32_t i = 0; i < block_len; ++i)
+            {
+                content_tfs[i] = ns_util::VarintUtil::Decode(&p);
             }
+        }
+    };
+
+    class Index;
+
+    //每个索引最多缓存的解码后的impact列表个数(不包括常驻内存的词)
+    const size_t HOT_TERM_CACHE_SIZE = 256;
+
+    //impact列表缓存的统计信息
+    struct HotTermStats
+    {
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t cached;//LRU中的impact列表个数
+        uint64_t pinned;//常驻内存的词数
+
+        HotTermStats()
+            :hits(0), misses(0), cached(0), pinned(0)
+        {}
+    };
+
+    //在内存中建立索引，最终序列化为索引镜像
+    class IndexBuilder
+    {
+    private:
+        struct BuildDoc
+        {
+            std::string title;
+            std::string content;
+            std::string url;
+            uint32_t title_length;//分词个数
+            uint32_t content_length;
+        };
+
+        //按段内的平均长度计算的长度归一化因子，只用于计算分数上界和impact列表的顺序
+        struct DocNorm
+        {
+            double title;
+            double content;
+        };
+
+        //建立过程中一个词的倒排拉链，doc_id按加入顺序递增
+        struct BuildPostings
+        {
+            std::vector<uint32_t> doc_ids;
+            std::vector<uint32_t> title_tfs;
+            std::vector<uint32_t> content_tfs;
+        };
+
+        std::vector<BuildDoc> docs;
+        TermDictionary dictionary;
+        std::vector<BuildPostings> postings;//按term_id下标
+        ns_util::FileUtil::FileStamp source;//索引对应的raw.txt，只由最终的builder设置
+        uint64_t source_hash;
+    public:
+        IndexBuilder()
+            :source_hash(0)
+        {}
+
+        size_t DocCount() const { return docs.size(); }
 
-            return instance;
+        void SetSource(const ns_util::FileUtil::FileStamp& stamp, uint64_t hash)
+        {
+            source = stamp;
+            source_hash = hash;
         }
 
-        //根据doc_id找到文档内容
-        DocInfo* GetForwardIndex(uint64_t doc_id)
+        //解析parser输出的一行数据，建立正排和倒排
+        bool AddDocument(const std::string& line)
         {
-            if(doc_id >= forward_index.size())
+            if(!BuildForwardIndex(line))
             {
-                std::cerr << "doc_id out of range" << std::endl;
-                return nullptr;
+                return false;
             }
-            return &forward_index[doc_id];
+            BuildInvertedIndex(docs.back(), docs.size() - 1);
+            return true;
         }
 
-        //根据关键字word获得倒排拉链
-        InvertedList* GetInvertedList(const std::string& word)
+        //把other中的文档按顺序追加到末尾，doc_id依次顺延，用于合并并行建立的局部索引
+        bool Merge(IndexBuilder&& other)
         {
-            if(inverted_index.find(word) == inverted_index.end())
+            if(docs.size() + other.docs.size() > UINT32_MAX)//doc_id以uint32_t保存
             {
-                std::cerr << word << " have not exist" << std::endl;
-                return nullptr;
+                return false;
+            }
+            const uint32_t base = static_cast<uint32_t>(docs.size());
+            for(BuildDoc& doc : other.docs)
+            {
+                docs.push_back(std::move(doc));
+            }
+            for(uint32_t other_id = 0; other_id < other.dictionary.size(); ++other_id)
+            {
+                BuildPostings& list = postings[InternTerm(other.dictionary.Term(other_id))];
+                BuildPostings& src = other.postings[other_id];
+                for(uint32_t doc_id : src.doc_ids)
+                {
+                    list.doc_ids.push_back(base + doc_id);
+                }
+                list.title_tfs.insert(list.title_tfs.end(), src.title_tfs.begin(), src.title_tfs.end());
+                list.content_tfs.insert(list.content_tfs.end(), src.content_tfs.begin(), src.content_tfs.end());
             }
-            return &inverted_index[word];
+            other.docs.clear();
+            other.dictionary.Clear();
+            other.postings.clear();
+            return true;
         }
 
-        //根据去标签，格式化之后的文档，构建正排和倒排索引
-        bool BuildIndex(const std::string& input)//获取parser处理完后的数据
+        //把一个已有索引中未删除的文档按顺序追加到末尾，直接复制倒排，不需要重新分词，用于合并段
+        //deleted: 删除标记，第i位为1表示doc_id为i的文档已经删除，可以为空
+        //remap: 输出旧doc_id在本builder中的新doc_id，已删除的为UINT32_MAX
+        bool AppendIndex(const Index& index, const std::vector<uint64_t>* deleted, std::vector<uint32_t>* remap);
+
+        //生成索引镜像
+        void Serialize(std::string* image) const
         {
-            std::ifstream in(input, std::ios::in | std::ios::binary);
-            if(!in.is_open())
+            //倒排按照word排序，镜像中的term_id与建立时的term_id无关
+            std::vector<uint32_t> terms(dictionary.size());
+            uint64_t posting_count = 0;
+            uint64_t block_count = 0;
+            for(uint32_t term_id = 0; term_id < terms.size(); ++term_id)
             {
-                std::cerr << "open file " << input << " failed!" << std::endl;
-                return false;
+                terms[term_id] = term_id;
+                posting_count += postings[term_id].doc_ids.size();
+                block_count += (postings[term_id].doc_ids.size() + BLOCK_SIZE - 1) / BLOCK_SIZE;
             }
+            std::sort(terms.begin(), terms.end(), [this](uint32_t t1, uint32_t t2)
+                                                    {return dictionary.Term(t1) < dictionary.Term(t2);});
 
-            std::string line;
-            int cnt = 0;
-            while(std::getline(in, line))
+            IndexHeader header;
+            std::memset(&header, 0, sizeof(header));
+            header.magic = INDEX_MAGIC;
+            header.version = INDEX_VERSION;
+            header.doc_count = docs.size();
+            for(const BuildDoc& doc : docs)
+            {
+                header.title_tokens += doc.title_length;
+                header.content_tokens += doc.content_length;
+            }
+            header.term_count = terms.size();
+            header.posting_count = posting_count;
+            header.source_inode = source.inode;
+            header.source_size = source.size;
+            header.source_mtime = source.mtime;
+            header.source_mtime_nsec = source.mtime_nsec;
+            header.source_hash = source_hash;
+            header.block_count = block_count;
+            header.docs_offset = Align(sizeof(IndexHeader));
+            header.terms_offset = Align(header.docs_offset + sizeof(DocRecord) * docs.size());
+            header.term_slots_offset = Align(header.terms_offset + sizeof(TermRecord) * terms.size());
+            header.term_slot_count = TermSlotCount(terms.size());
+            header.blocks_offset = Align(header.term_slots_offset + sizeof(TermSlot) * header.term_slot_count);
+            header.postings_offset = Align(header.blocks_offset + sizeof(BlockRecord) * block_count);
+
+            //分数上界和impact列表的顺序按段内的平均长度计算，查询时再换算到整个快照
+            double avg_title = docs.empty() ? 0 : static_cast<double>(header.title_tokens) / docs.size();
+            double avg_content = docs.empty() ? 0 : static_cast<double>(header.content_tokens) / docs.size();
+            std::string strings;
+            std::vector<DocRecord> doc_records(docs.size());
+            std::vector<DocNorm> norms(docs.size());
+            for(size_t i = 0; i < docs.size(); ++i)
+            {
+                DocRecord& record = doc_records[i];
+                std::memset(&record, 0, sizeof(record));
+                record.title_offset = AppendString(&strings, docs[i].title, &record.title_size);
+                record.content_offset = AppendString(&strings, docs[i].content, &record.content_size);
+                record.url_offset = AppendString(&strings, docs[i].url, &record.url_size);
+                record.title_length = docs[i].title_length;
+                record.content_length = docs[i].content_length;
+                norms[i].title = Bm25Norm(BM25_TITLE_B, docs[i].title_length, avg_title);
+                norms[i].content = Bm25Norm(BM25_CONTENT_B, docs[i].content_length, avg_content);
+            }
+
+            std::vector<TermRecord> term_records(terms.size());
+            TermSlot empty_slot;
+            empty_slot.hash = 0;
+            empty_slot.term = 0;
+            std::vector<TermSlot> term_slots(header.term_slot_count, empty_slot);
+            std::vector<BlockRecord> block_records;
+            std::string posting_data;
+            std::string impact_data;
+            block_records.reserve(block_count);
+            for(size_t i = 0; i < terms.size(); ++i)
             {
-                DocInfo* doc = BuildForwardIndex(line);
-                if(nullptr == doc)
+                const BuildPostings& list = postings[terms[i]];
+                const boost::string_view word = dictionary.Term(terms[i]);
+                TermRecord& record = term_records[i];
+                std::memset(&record, 0, sizeof(record));
+                record.word_offset = AppendString(&strings, word, &record.word_size);
+                PlaceTerm(&term_slots, TermHash(word), static_cast<uint32_t>(i));
+                record.doc_freq = static_cast<uint32_t>(list.doc_ids.size());
+                record.block_begin = block_records.size();
+                EncodePostings(list, norms, &record, &block_records, &posting_data);
+                if(list.doc_ids.size() >= IMPACT_MIN_DF)
                 {
-                    std::cerr << "build " << line << " error!" << std::endl;
-                    continue;
+                    EncodeImpacts(list, norms, &record, &impact_data);
                 }
-                
-                BuildInvertedIndex(*doc);
-                //for debug
-                ++cnt;
-                if(cnt % 500 == 0)
-                    LOG(NORMAL, "当前已建立的索引文档: " + std::to_string(cnt));
             }
+            header.postings_size = posting_data.size();
+            header.impacts_offset = Align(header.postings_offset + posting_data.size());
+            header.impacts_size = impact_data.size();
+            header.strings_offset = Align(header.impacts_offset + impact_data.size());
+            header.strings_size = strings.size();
 
-            return true;
+            image->assign(header.strings_offset + strings.size(), '\0');
+            char* base = &(*image)[0];
+            std::memcpy(base, &header, sizeof(header));
+            CopyArray(base + header.docs_offset, doc_records);
+            CopyArray(base + header.terms_offset, term_records);
+            CopyArray(base + header.term_slots_offset, term_slots);
+            CopyArray(base + header.blocks_offset, block_records);
+            if(!posting_data.empty())
+            {
+                std::memcpy(base + header.postings_offset, posting_data.data(), posting_data.size());
+            }
+            if(!impact_data.empty())
+            {
+                std::memcpy(base + header.impacts_offset, impact_data.data(), impact_data.size());
+            }
+            if(!strings.empty())
+            {
+                std::memcpy(base + header.strings_offset, strings.data(), strings.size());
+            }
         }
     private:
-        DocInfo* BuildForwardIndex(const std::string& line)
+        static uint64_t Align(uint64_t offset)
+        {
+            return (offset + 7) & ~static_cast<uint64_t>(7);
+        }
+
+        static uint64_t AppendString(std::string* strings, boost::string_view s, uint32_t* size)
+        {
+            uint64_t offset = strings->size();
+            strings->append(s.data(), s.size());
+            *size = static_cast<uint32_t>(s.size());
+            return offset;
+        }
+
+        static void PlaceTerm(std::vector<TermSlot>* slots, uint32_t hash, uint32_t term_id)
+        {
+            const size_t mask = slots->size() - 1;
+            size_t i = hash & mask;
+            while((*slots)[i].term != 0)
+            {
+                i = (i + 1) & mask;
+            }
+            (*slots)[i].hash = hash;
+            (*slots)[i].term = term_id + 1;
+        }
+
+        //word的term_id，第一次出现时加入词典并分配空的倒排拉链
+        uint32_t InternTerm(boost::string_view word)
+        {
+            uint32_t term_id = dictionary.Intern(word);
+            if(term_id == postings.size())
+            {
+                postings.emplace_back();
+            }
+            return term_id;
+        }
+
+        //按块压缩一个词的倒排拉链，每块生成一个跳表项，同时记录整个拉链以及每块的分数上界
+        static void EncodePostings(const BuildPostings& list, const std::vector<DocNorm>& norms,
+                                   TermRecord* term, std::vector<BlockRecord>* blocks, std::string* data)
+        {
+            uint32_t prev_doc_id = 0;
+            for(size_t begin = 0; begin < list.doc_ids.size(); begin += BLOCK_SIZE)
+            {
+                size_t end = std::min<size_t>(begin + BLOCK_SIZE, list.doc_ids.size());
+                BlockRecord block;
+                std::memset(&block, 0, sizeof(block));
+                block.offset = data->size();
+                block.last_doc_id = list.doc_ids[end - 1];
+                for(size_t i = begin; i < end; ++i)
+                {
+                    ns_util::VarintUtil::Encode(list.doc_ids[i] - prev_doc_id, data);
+                    prev_doc_id = list.doc_ids[i];
+                }
+                for(size_t i = begin; i < end; ++i)
+                {
+                    ns_util::VarintUtil::Encode(list.title_tfs[i], data);
+                }
+                for(size_t i = begin; i < end; ++i)
+                {
+                    ns_util::VarintUtil::Encode(list.content_tfs[i], data);
+                }
+
+                double max_bm25 = 0;
+                for(size_t i = begin; i < end; ++i)
+                {
+                    const DocNorm& norm = norms[list.doc_ids[i]];
+                    block.max_weight = std::max(block.max_weight, TermWeight(list.title_tfs[i], list.content_tfs[i]));
+                    max_bm25 = std::max(max_bm25, Bm25Tf(list.title_tfs[i], list.content_tfs[i], norm.title, norm.content));
+                }
+                block.max_bm25 = RoundUp(max_bm25);
+                term->max_weight = std::max(term->max_weight, block.max_weight);
+                term->max_bm25 = std::max(term->max_bm25, block.max_bm25);
+                blocks->push_back(block);
+            }
+        }
+
+        //保存高频词的impact列表：分别按weight和BM25词频饱和值(按段内的平均长度计算)降序排列，各取前IMPACT_TOP_N个
+        static void EncodeImpacts(const BuildPostings& list, const std::vector<DocNorm>& norms,
+                                  TermRecord* term, std::string* data)
+        {
+            const size_t count = std::min<size_t>(IMPACT_TOP_N, list.doc_ids.size());
+            std::vector<double> scores(list.doc_ids.size());
+            std::vector<uint32_t> order(list.doc_ids.size());
+            term->impact_offset = data->size();
+            term->impact_count = static_cast<uint32_t>(count);
+            for(int mode = IMPACT_WEIGHT; mode < IMPACT_ORDER_COUNT; ++mode)
+            {
+                if(mode == IMPACT_BM25)
+                {
+                    term->impact_bm25_offset = static_cast<uint32_t>(data->size() - term->impact_offset);
+                }
+                for(size_t i = 0; i < list.doc_ids.size(); ++i)
+                {
+                    const DocNorm& norm = norms[list.doc_ids[i]];
+                    scores[i] = mode == IMPACT_BM25 ? Bm25Tf(list.title_tfs[i], list.content_tfs[i], norm.title, norm.content)
+                                                    : TermWeight(list.title_tfs[i], list.content_tfs[i]);
+                    order[i] = static_cast<uint32_t>(i);
+                }
+                //下标与doc_id的顺序一致，分数相同时下标小的在前
+                std::partial_sort(order.begin(), order.begin() + count, order.end(), [&scores](uint32_t i1, uint32_t i2)
+                                  {return scores[i1] > scores[i2] || (scores[i1] == scores[i2] && i1 < i2);});
+                for(size_t i = 0; i < count; ++i)
+                {
+                    ns_util::VarintUtil::Encode(list.doc_ids[order[i]], data);
+                    ns_util::VarintUtil::Encode(list.title_tfs[order[i]], data);
+                    ns_util::VarintUtil::Encode(list.content_tfs[order[i]], data);
+                }
+            }
+        }
+
+        template<class T>
+        static void CopyArray(char* dst, const std::vector<T>& src)
+        {
+            if(!src.empty())
+            {
+                std::memcpy(dst, src.data(), sizeof(T) * src.size());
+            }
+        }
+
+        bool BuildForwardIndex(const std::string& line)
         {
             //1.解析line，字符串切分
             //line -> 3个string : title, content, url
             std::vector<std::string> results;
             const std::string sep = "\3";
             ns_util::StringUtil::CutString(line, &results, sep);
-            if(results.size() != 3)
+            if(results.size() != 3 || docs.size() >= UINT32_MAX)//doc_id以uint32_t保存
             {
-                return nullptr;
+                return false;
             }
 
-            //2.字符串填充到DocInfo
-            DocInfo doc;
-            doc.title = results[0];
-            doc.content = results[1];
-            doc.url = results[2];
-            doc.doc_id =  forward_index.size();
-
-            //3.插入到正排索引的vector
-            forward_index.push_back(std::move(doc));
-
-            return &forward_index.back();
+            //2.字符串填充到BuildDoc，并插入到正排的vector
+            BuildDoc doc;
+            doc.title = std::move(results[0]);
+            doc.content = std::move(results[1]);
+            doc.url = std::move(results[2]);
+            docs.push_back(std::move(doc));
+            return true;
         }
 
-        void BuildInvertedIndex(const DocInfo& doc)
+        void BuildInvertedIndex(BuildDoc& doc, uint32_t doc_id)
         {
             //word -> 倒排拉链
             //保存word分别在title,content中出现的次数
@@ -153,49 +850,1018 @@ namespace ns_index
             };
 
             //1.分别对title和content进行分词，并统计词频
-            //将word与出现的次数建立映射
-            std::unordered_map<std::string, word_cnt> word_cnt_map;
+            //将word的term_id与出现的次数建立映射
+            std::unordered_map<uint32_t, word_cnt> word_cnt_map;
+
+            //分词结果直接指向doc中的title/content，小写化在一个复用的缓冲区中进行，
+            //词本身只在第一次出现时复制到词典的arena中
+            std::string word;
 
             //对title进行分词
-            std::vector<std::string> title_words;
+            std::vector<boost::string_view> title_words;
             ns_util::JiebaUtil::WordSegmentation(doc.title, &title_words);
-            
+
             //词频统计
-            for(std::string s : title_words)
+            for(boost::string_view s : title_words)
             {
-                boost::to_lower(s);//将我们的分词统一转化为小写
-                ++word_cnt_map[s].title_cnt;
+                word.assign(s.data(), s.size());
+                boost::to_lower(word);//将我们的分词统一转化为小写
+                ++word_cnt_map[InternTerm(word)].title_cnt;
             }
 
             //对content进行分词
-            std::vector<std::string> content_words;
+            std::vector<boost::string_view> content_words;
             ns_util::JiebaUtil::WordSegmentation(doc.content, &content_words);
-            
+
             //词频统计
-            for(std::string s : content_words)
+            for(boost::string_view s : content_words)
             {
-                boost::to_lower(s);//将我们的分词统一转化为小写
-                ++word_cnt_map[s].content_cnt;
+                word.assign(s.data(), s.size());
+                boost::to_lower(word);//将我们的分词统一转化为小写
+                ++word_cnt_map[InternTerm(word)].content_cnt;
             }
 
-            //2.构建倒排拉链
-            //自定义title和content中出现的词所占的权重
-            const int title_wight = 10;
-            const int content_weight = 1;
-            //构建倒排元素
+            //字段长度用于BM25F的长度归一化
+            doc.title_length = static_cast<uint32_t>(title_words.size());
+            doc.content_length = static_cast<uint32_t>(content_words.size());
+
+            //2.构建倒排拉链：保存title和content中的词频，打分时再按照所选的打分方式计算
             for(auto& word_pair : word_cnt_map)
             {
-                InvertedElem item;
-                item.doc_id = doc.doc_id;
-                item.word = word_pair.first;
-                item.weight = word_pair.second.title_cnt * title_wight + 
-                              word_pair.second.content_cnt * content_weight;
-
                 //将倒排元素插入到倒排拉链中
-                inverted_index[word_pair.first].push_back(std::move(item));
+                BuildPostings& list = postings[word_pair.first];
+                list.doc_ids.push_back(doc_id);
+                list.title_tfs.push_back(word_pair.second.title_cnt);
+                list.content_tfs.push_back(word_pair.second.content_cnt);
             }
         }
     };
-    Index* Index::instance = nullptr;
-    std::mutex Index::mtx;
-}
\ No newline at end of file
+
+    //一份索引快照：建立或加载完成之后只读，查询用到的接口都是const，多个线程可以同时查询，不需要加锁
+    //BuildIndex/LoadIndex只在发布之前调用；重新建立索引时创建新的Index对象，以shared_ptr整体替换旧快照
+    class Index
+    {
+    private:
+        //索引镜像：mmap的索引文件，或者在内存中建立的镜像
+        ns_util::MmapFile mapped_image;
+        std::string owned_image;
+
+        const IndexHeader* header;
+        const DocRecord* docs;//正排索引
+        const TermRecord* terms;//倒排索引的词典
+        const TermSlot* term_slots;//词典的哈希表
+        const BlockRecord* blocks;//倒排拉链的跳表
+        const uint8_t* posting_data;//倒排拉链的压缩数据
+        const uint8_t* impact_data;//高频词的impact列表
+        const char* strings;
+
+        //一个词的一种排序方式解码后的impact列表，用atomic_load/atomic_store读写，命中时不需要加锁
+        struct ImpactSlot
+        {
+            std::shared_ptr<const ImpactList> impacts;//没有缓存时为空
+            std::atomic<bool> referenced;//上一次淘汰检查之后是否被访问过
+            bool pinned;//常驻内存，不会被淘汰
+
+            ImpactSlot()
+                :referenced(false), pinned(false)
+            {}
+        };
+        //有impact列表的词，按term_id递增，下标乘以IMPACT_ORDER_COUNT再加上排序方式即为impact_slots的下标
+        std::vector<uint32_t> impact_terms;
+        std::unique_ptr<ImpactSlot[]> impact_slots;
+        //常驻内存的词在发布之前解码好，之后只读；其他的词最多缓存HOT_TERM_CACHE_SIZE个，按CLOCK算法近似LRU淘汰
+        //只有未命中时才持有hot_mtx：放入新解码的列表，以及移动时钟指针淘汰最近没有被访问过的列表
+        mutable std::mutex hot_mtx;
+        mutable std::vector<size_t> hot_clock;//缓存中的impact_slots下标
+        mutable size_t hot_hand;//下一个淘汰检查的位置
+        mutable std::atomic<uint64_t> hot_hits;
+        mutable std::atomic<uint64_t> hot_misses;
+        std::unordered_map<uint32_t, DecodedPostings> pinned_postings;//常驻内存的词解码好的倒排拉链
+
+        //并行建立索引时每块的行数
+        static const size_t BUILD_CHUNK_LINES = 256;
+
+        //并行建立索引时的一块数据及其局部索引，seq为块的序号
+        struct BuildChunk
+        {
+            size_t seq;
+            std::vector<std::string> lines;
+            IndexBuilder builder;
+
+            explicit BuildChunk(size_t n)
+                :seq(n)
+            {}
+        };
+    public:
+        Index()
+            :header(nullptr), docs(nullptr), terms(nullptr), term_slots(nullptr), blocks(nullptr), posting_data(nullptr), impact_data(nullptr),
+             strings(nullptr), hot_hand(0), hot_hits(0), hot_misses(0)
+        {}
+        Index(const Index&) = delete;
+        Index& operator=(const Index&) = delete;
+        ~Index(){}
+    public:
+
+        uint64_t DocCount() const
+        {
+            return header == nullptr ? 0 : header->doc_count;
+        }
+
+        uint64_t TermCount() const
+        {
+            return header == nullptr ? 0 : header->term_count;
+        }
+
+        //索引镜像的字节数
+        uint64_t ImageSize() const
+        {
+            return header == nullptr ? 0 : header->strings_offset + header->strings_size;
+        }
+
+        //根据doc_id找到文档内容
+        bool GetForwardIndex(uint64_t doc_id, DocInfo* doc) const
+        {
+            if(doc_id >= DocCount())
+            {
+                std::cerr << "doc_id out of range" << std::endl;
+                return false;
+            }
+            const DocRecord& record = docs[doc_id];
+            doc->title = GetString(record.title_offset, record.title_size);
+            doc->content = GetString(record.content_offset, record.content_size);
+            doc->url = GetString(record.url_offset, record.url_size);
+            doc->doc_id = doc_id;
+            return true;
+        }
+
+        //根据关键字word查找term_id
+        //在词典的哈希表中查找，有多个段时查询的词不在某些段中是正常的
+        bool FindTerm(boost::string_view word, uint32_t* term_id) const
+        {
+            if(header == nullptr)
+            {
+                return false;
+            }
+            const uint32_t hash = TermHash(word);
+            const uint64_t mask = header->term_slot_count - 1;
+            for(uint64_t i = hash & mask; term_slots[i].term != 0; i = (i + 1) & mask)
+            {
+                const TermRecord& record = terms[term_slots[i].term - 1];
+                if(term_slots[i].hash == hash && GetString(record.word_offset, record.word_size) == word)
+                {
+                    *term_id = term_slots[i].term - 1;
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        //文档title和content的分词个数
+        void GetDocLengths(uint64_t doc_id, uint32_t* title_length, uint32_t* content_length) const
+        {
+            *title_length = docs[doc_id].title_length;
+            *content_length = docs[doc_id].content_length;
+        }
+
+        //所有文档(包括已经删除的)title和content的分词个数之和
+        uint64_t TitleTokens() const
+        {
+            return header == nullptr ? 0 : header->title_tokens;
+        }
+
+        uint64_t ContentTokens() const
+        {
+            return header == nullptr ? 0 : header->content_tokens;
+        }
+
+        //建立索引时使用的段内平均长度，分数上界和impact列表的顺序按它计算
+        Bm25Averages LocalAverages() const
+        {
+            Bm25Averages averages;
+            if(DocCount() > 0)
+            {
+                averages.title = static_cast<double>(TitleTokens()) / DocCount();
+                averages.content = static_cast<double>(ContentTokens()) / DocCount();
+            }
+            return averages;
+        }
+
+        //doc中某个词的BM25F分数，长度归一化因子按averages在查询时计算
+        double Bm25(double idf, const Bm25Averages& averages, uint32_t doc_id, uint32_t title_tf, uint32_t content_tf) const
+        {
+            const DocRecord& record = docs[doc_id];
+            return idf * Bm25Tf(title_tf, content_tf, Bm25Norm(BM25_TITLE_B, record.title_length, averages.title),
+                                Bm25Norm(BM25_CONTENT_B, record.content_length, averages.content));
+        }
+
+        //按段内平均长度计算的BM25词频饱和值，与max_bm25和impact列表的顺序一致
+        double LocalBm25Tf(uint32_t doc_id, uint32_t title_tf, uint32_t content_tf) const
+        {
+            const DocRecord& record = docs[doc_id];
+            const Bm25Averages local = LocalAverages();
+            return Bm25Tf(title_tf, content_tf, Bm25Norm(BM25_TITLE_B, record.title_length, local.title),
+                          Bm25Norm(BM25_CONTENT_B, record.content_length, local.content));
+        }
+
+        //把段内的BM25上界(max_bm25、impact列表中的LocalBm25Tf)换算成按averages计算的上界需要乘的倍数
+        //两个字段的归一化因子都至少变为原来的floor倍时，合并后的词频至多变为1/floor倍，
+        //饱和函数x/(k1 + x)是凹函数并且过原点，饱和值也至多变为1/floor倍
+        double Bm25BoundScale(const Bm25Averages& averages) const
+        {
+            const Bm25Averages local = LocalAverages();
+            double floor = std::min(Bm25NormFloor(BM25_TITLE_B, local.title, averages.title),
+                                    Bm25NormFloor(BM25_CONTENT_B, local.content, averages.content));
+            return 1 / floor;
+        }
+
+        //根据term_id获得词本身
+        boost::string_view GetTerm(uint32_t term_id) const
+        {
+            const TermRecord& record = terms[term_id];
+            return GetString(record.word_offset, record.word_size);
+        }
+
+        //根据term_id获得倒排拉链
+        InvertedList GetInvertedList(uint32_t term_id) const
+        {
+            const TermRecord& record = terms[term_id];
+            auto iter = pinned_postings.empty() ? pinned_postings.end() : pinned_postings.find(term_id);
+            return InvertedList(blocks + record.block_begin, posting_data, record,
+                                iter == pinned_postings.end() ? nullptr : &iter->second);
+        }
+
+        //高频词按order降序排列的前若干个倒排元素，没有impact列表时返回空指针
+        //列表长度等于倒排拉链长度时包含了全部的倒排元素
+        std::shared_ptr<const ImpactList> GetImpactList(uint32_t term_id, ImpactOrder order) const
+        {
+            if(terms[term_id].impact_count == 0)
+            {
+                return nullptr;
+            }
+            const size_t index = ImpactSlotIndex(term_id, order);
+            ImpactSlot& slot = impact_slots[index];
+            std::shared_ptr<const ImpactList> impacts = std::atomic_load(&slot.impacts);
+            if(impacts != nullptr)
+            {
+                ++hot_hits;
+                //已经标记过时不再写，避免多个查询线程反复写同一个缓存行
+                if(!slot.referenced.load(std::memory_order_relaxed))
+                {
+                    slot.referenced.store(true, std::memory_order_relaxed);
+                }
+                return impacts;
+            }
+            ++hot_misses;
+            //解码不持有锁，两个线程同时解码同一个词时先放入的生效
+            impacts = DecodeImpacts(term_id, order);
+            std::lock_guard<std::mutex> lock(hot_mtx);
+            std::shared_ptr<const ImpactList> cached = std::atomic_load(&slot.impacts);
+            if(cached != nullptr)
+            {
+                return cached;
+            }
+            if(hot_clock.size() < HOT_TERM_CACHE_SIZE)
+            {
+                hot_clock.push_back(index);
+            }
+            else
+            {
+                //跳过并清除最近被访问过的列表，淘汰第一个没有被访问过的，最多转两圈
+                while(impact_slots[hot_clock[hot_hand]].referenced.exchange(false, std::memory_order_relaxed))
+                {
+                    hot_hand = (hot_hand + 1) % hot_clock.size();
+                }
+                //正在使用被淘汰的列表的查询持有shared_ptr，不受影响
+                std::atomic_store(&impact_slots[hot_clock[hot_hand]].impacts, std::shared_ptr<const ImpactList>());
+                hot_clock[hot_hand] = index;
+                hot_hand = (hot_hand + 1) % hot_clock.size();
+            }
+            slot.referenced.store(false, std::memory_order_relaxed);
+            std::atomic_store(&slot.impacts, impacts);
+            return impacts;
+        }
+
+        //文档频率最高的count个词常驻内存：预先解码整个倒排拉链和impact列表
+        //只能在发布之前调用，重新建立或加载索引之后失效
+        void PinHotTerms(size_t count)
+        {
+            pinned_postings.clear();
+            ResetImpactSlots();
+            count = std::min<size_t>(count, TermCount());
+            if(count == 0)
+            {
+                return;
+            }
+            std::vector<uint32_t> term_ids(TermCount());
+            for(uint32_t i = 0; i < term_ids.size(); ++i)
+            {
+                term_ids[i] = i;
+            }
+            std::partial_sort(term_ids.begin(), term_ids.begin() + count, term_ids.end(), [this](uint32_t t1, uint32_t t2)
+                              {return terms[t1].doc_freq > terms[t2].doc_freq || (terms[t1].doc_freq == terms[t2].doc_freq && t1 < t2);});
+            for(size_t i = 0; i < count; ++i)
+            {
+                const uint32_t term_id = term_ids[i];
+                DecodedPostings decoded;
+                for(PostingIterator iter(GetInvertedList(term_id)); !iter.End(); iter.Next())
+                {
+                    decoded.doc_ids.push_back(iter.DocId());
+                    decoded.title_tfs.push_back(iter.TitleTf());
+                    decoded.content_tfs.push_back(iter.ContentTf());
+                }
+                pinned_postings[term_id] = std::move(decoded);
+                if(terms[term_id].impact_count == 0)
+                {
+                    continue;
+                }
+                for(int order = IMPACT_WEIGHT; order < IMPACT_ORDER_COUNT; ++order)
+                {
+                    ImpactSlot& slot = impact_slots[ImpactSlotIndex(term_id, static_cast<ImpactOrder>(order))];
+                    slot.impacts = DecodeImpacts(term_id, static_cast<ImpactOrder>(order));
+                    slot.pinned = true;
+                }
+            }
+        }
+
+        HotTermStats GetHotTermStats() const
+        {
+            HotTermStats stats;
+            stats.hits = hot_hits;
+            stats.misses = hot_misses;
+            stats.pinned = pinned_postings.size();
+            std::lock_guard<std::mutex> lock(hot_mtx);
+            stats.cached = hot_clock.size();
+            return stats;
+        }
+
+        //根据关键字word获得倒排拉链，word不存在时返回空拉链
+        InvertedList GetInvertedList(const std::string& word) const
+        {
+            uint32_t term_id = 0;
+            if(!FindTerm(word, &term_id))
+            {
+                return InvertedList();
+            }
+            return GetInvertedList(term_id);
+        }
+
+        //根据去标签，格式化之后的文档，构建正排和倒排索引
+        //读文件的线程把数据按行切成块，thread_num个分词线程各自为一块建立局部的正排和倒排，
+        //再按块的顺序依次合并，doc_id与逐行建立时完全相同；thread_num为0时使用全部的核
+        bool BuildIndex(const std::string& input, size_t thread_num = 0)//获取parser处理完后的数据
+        {
+            //先记下raw.txt的状态再读，读的过程中raw.txt被改写时下次启动会认为索引过期
+            ns_util::FileUtil::FileStamp source;
+            uint64_t source_hash = 0;
+            if(!ReadSource(input, &source, &source_hash))
+            {
+                return false;
+            }
+            std::ifstream in(input, std::ios::in | std::ios::binary);
+            if(!in.is_open())
+            {
+                std::cerr << "open file " << input << " failed!" << std::endl;
+                return false;
+            }
+            if(thread_num == 0)
+            {
+                thread_num = std::max<size_t>(1, std::thread::hardware_concurrency());
+            }
+
+            //待分词的块，空指针表示没有更多的块
+            limonp::BoundedBlockingQueue<std::shared_ptr<BuildChunk> > tasks(thread_num * 2);
+            //分词完成、等待按顺序合并的块
+            std::map<size_t, std::shared_ptr<BuildChunk> > done;
+            std::mutex done_mtx;
+            std::condition_variable done_cond;
+
+            std::vector<std::thread> workers;
+            for(size_t i = 0; i < thread_num; ++i)
+            {
+                workers.emplace_back([&tasks, &done, &done_mtx, &done_cond]()
+                {
+                    std::shared_ptr<BuildChunk> chunk;
+                    while((chunk = tasks.Pop()) != nullptr)
+                    {
+                        for(const std::string& line : chunk->lines)
+                        {
+                            if(!chunk->builder.AddDocument(line))
+                            {
+                                std::cerr << "build " << line << " error!" << std::endl;
+                            }
+                        }
+                        chunk->lines.clear();
+
+                        std::lock_guard<std::mutex> lock(done_mtx);
+                        done[chunk->seq] = chunk;
+                        done_cond.notify_one();
+                    }
+                });
+            }
+
+            IndexBuilder builder;
+            size_t merged = 0;//已经合并的块数
+            bool ok = true;
+            //合并已经完成的块，wait_count表示至少要合并到第几块
+            auto merge_ready = [&](size_t wait_count)
+            {
+                std::unique_lock<std::mutex> lock(done_mtx);
+                while(true)
+                {
+                    auto iter = done.find(merged);
+                    if(iter == done.end())
+                    {
+                        if(merged >= wait_count)
+                        {
+                            break;
+                        }
+                        done_cond.wait(lock);
+                        continue;
+                    }
+                    std::shared_ptr<BuildChunk> chunk = iter->second;
+                    done.erase(iter);
+                    lock.unlock();
+
+                    size_t before = builder.DocCount();
+                    if(!builder.Merge(std::move(chunk->builder)))
+                    {
+                        std::cerr << "too many documents, chunk " << merged << " dropped" << std::endl;
+                        ok = false;
+                    }
+                    //for debug
+                    if(builder.DocCount() / 500 != before / 500)
+                        LOG(NORMAL, "当前已建立的索引文档: " + std::to_string(builder.DocCount()));
+                    ++merged;
+                    lock.lock();
+                }
+            };
+
+            size_t chunk_count = 0;
+            std::shared_ptr<BuildChunk> chunk = std::make_shared<BuildChunk>(chunk_count);
+            std::string line;
+            while(std::getline(in, line))
+            {
+                chunk->lines.push_back(std::move(line));
+                if(chunk->lines.size() == BUILD_CHUNK_LINES)
+                {
+                    tasks.Push(chunk);
+                    chunk = std::make_shared<BuildChunk>(++chunk_count);
+                    merge_ready(0);
+                }
+            }
+            if(!chunk->lines.empty())
+            {
+                tasks.Push(chunk);
+                ++chunk_count;
+            }
+            for(size_t i = 0; i < thread_num; ++i)
+            {
+                tasks.Push(std::shared_ptr<BuildChunk>());
+            }
+            merge_ready(chunk_count);
+            for(std::thread& worker : workers)
+            {
+                worker.join();
+            }
+            if(!ok)
+            {
+                return false;
+            }
+
+            builder.SetSource(source, source_hash);
+            return BuildIndex(builder);
+        }
+
+        //在base的基础上应用parser生成的变化(格式见parser.cc中的delta_path)，不需要重新分词没有变化的文档：
+        //base中被更新或删除的文档不再保留，其余文档的倒排直接复制，新增和更新的文档排在最后
+        //变化中要求重新建立索引，或者格式有误时返回false，此时应根据raw.txt重新建立索引
+        //input为应用变化之后的raw.txt，只用来记录索引对应的raw.txt的状态
+        bool BuildIndex(const Index& base, const std::string& delta, const std::string& input, size_t thread_num = 0)
+        {
+            ns_util::FileUtil::FileStamp source;
+            uint64_t source_hash = 0;
+            if(!ReadSource(input, &source, &source_hash))
+            {
+                return false;
+            }
+            std::string text;
+            if(!ns_util::FileUtil::ReadFile(delta, &text))
+            {
+                return false;
+            }
+            std::vector<std::string> lines;
+            ns_util::StringUtil::CutString(text, &lines, "\n");
+
+            //同一个url以最后一条为准，删除时为空
+            std::unordered_map<std::string, std::string> latest;
+            std::vector<std::string> urls;//按第一次出现的顺序
+            for(std::string& line : lines)
+            {
+                if(line.empty())
+                {
+                    continue;
+                }
+                if(line == "*")
+                {
+                    LOG(NORMAL, "raw.txt已经全部重新生成，需要重新建立索引");
+                    return false;
+                }
+                std::string url;
+                if(line[0] == '-')
+                {
+                    url = line.substr(1);
+                    line.clear();
+                }
+                else if(line[0] == '+' && std::count(line.begin(), line.end(), '\3') == 2)
+                {
+                    url = line.substr(line.rfind('\3') + 1);
+                    line.erase(0, 1);
+                }
+                else
+                {
+                    std::cerr << "bad delta " << delta << ": " << line.substr(0, 64) << std::endl;
+                    return false;
+                }
+                auto result = latest.emplace(url, std::string());
+                if(result.second)
+                {
+                    urls.push_back(url);
+                }
+                result.first->second.swap(line);
+            }
+
+            //1.base中url有变化的文档全部删除，其余的原样追加
+            std::vector<uint64_t> deleted((base.DocCount() + 63) / 64, 0);
+            uint64_t removed = 0;
+            DocInfo doc;
+            for(uint64_t i = 0; i < base.DocCount(); ++i)
+            {
+                base.GetForwardIndex(i, &doc);
+                if(latest.find(doc.url.to_string()) != latest.end())
+                {
+                    deleted[i / 64] |= static_cast<uint64_t>(1) << (i % 64);
+                    ++removed;
+                }
+            }
+            IndexBuilder builder;
+            std::vector<uint32_t> remap;
+            if(!builder.AppendIndex(base, &deleted, &remap))
+            {
+                return false;
+            }
+
+            //2.新增和更新的文档分成thread_num份并行分词，再按顺序合并
+            std::vector<const std::string*> added;
+            for(const std::string& url : urls)
+            {
+                const std::string& line = latest[url];
+                if(!line.empty())
+                {
+                    added.push_back(&line);
+                }
+            }
+            if(thread_num == 0)
+            {
+                thread_num = std::max<size_t>(1, std::thread::hardware_concurrency());
+            }
+            thread_num = std::max<size_t>(1, std::min(thread_num, added.size()));
+            std::vector<IndexBuilder> parts(thread_num);
+            std::vector<std::thread> workers;
+            for(size_t t = 0; t < thread_num; ++t)
+            {
+                workers.emplace_back([&added, &parts, t, thread_num]()
+                {
+                    size_t begin = added.size() * t / thread_num;
+                    size_t end = added.size() * (t + 1) / thread_num;
+                    for(size_t i = begin; i < end; ++i)
+                    {
+                        if(!parts[t].AddDocument(*added[i]))
+                        {
+                            std::cerr << "build " << *added[i] << " error!" << std::endl;
+                        }
+                    }
+                });
+            }
+            for(std::thread& worker : workers)
+            {
+                worker.join();
+            }
+            for(IndexBuilder& part : parts)
+            {
+                if(!builder.Merge(std::move(part)))
+                {
+                    std::cerr << "too many documents" << std::endl;
+                    return false;
+                }
+            }
+            LOG(NORMAL, "应用增量: 删除或更新的文档 " + std::to_string(removed) + ", 新增或更新的文档 " +
+                        std::to_string(added.size()) + ", 文档总数 " + std::to_string(builder.DocCount()));
+            builder.SetSource(source, source_hash);
+            return BuildIndex(builder);
+        }
+
+        //由内存中建立好的builder生成索引镜像
+        bool BuildIndex(const IndexBuilder& builder)
+        {
+            std::string image;
+            builder.Serialize(&image);
+            mapped_image.Close();
+            owned_image.swap(image);
+            Attach(owned_image.data());
+            return true;
+        }
+
+        //将索引镜像原样保存为索引文件，供服务启动时直接mmap
+        //先写临时文件再rename：正在使用旧文件映射的进程不受影响，也不会加载到写了一半的文件
+        bool SaveIndex(const std::string& output) const
+        {
+            if(header == nullptr)
+            {
+                std::cerr << "index is empty, nothing to save" << std::endl;
+                return false;
+            }
+            const char* base = reinterpret_cast<const char*>(header);
+            size_t size = ImageSize();
+
+            const std::string tmp = output + ".tmp";
+            std::ofstream out(tmp, std::ios::out | std::ios::binary);
+            if(!out.is_open())
+            {
+                std::cerr << "open file " << tmp << " failed!" << std::endl;
+                return false;
+            }
+            out.write(base, size);
+            out.close();
+            if(!out)
+            {
+                std::cerr << "write file " << tmp << " failed!" << std::endl;
+                unlink(tmp.c_str());
+                return false;
+            }
+            if(rename(tmp.c_str(), output.c_str()) != 0)
+            {
+                std::cerr << "rename " << tmp << " to " << output << " failed!" << std::endl;
+                unlink(tmp.c_str());
+                return false;
+            }
+            return true;
+        }
+
+        //mmap indexer生成的索引文件，正排和倒排直接在映射上访问，不需要反序列化
+        //默认只检查文件头、各条记录和各段的范围，不读倒排数据，加载时间与倒排大小无关，index.bin视为indexer生成的可信文件；
+        //verify为true时再完整解码一遍全部的倒排块和impact列表，保证查询时解码出来的doc_id不会越界
+        bool LoadIndex(const std::string& input, bool verify = false)
+        {
+            ns_util::MmapFile file;
+            if(!file.Open(input))
+            {
+                return false;
+            }
+            //校验通过后才替换当前镜像
+            if(!CheckImage(file.Data(), file.Size(), input, verify))
+            {
+                return false;
+            }
+            mapped_image.Swap(file);
+            owned_image.clear();
+            owned_image.shrink_to_fit();
+            Attach(mapped_image.Data());
+            return true;
+        }
+        //索引是否由当前的input建立：状态相同时直接认为相同；状态变了(比如被touch或者复制)但大小相同时再比较内容的哈希
+        //input不存在时没有可以比较的，认为索引可用
+        bool MatchesSource(const std::string& input) const
+        {
+            if(header == nullptr)
+            {
+                return false;
+            }
+            ns_util::FileUtil::FileStamp stamp;
+            if(!ns_util::FileUtil::GetFileStamp(input, &stamp))
+            {
+                return true;
+            }
+            if(stamp.inode == header->source_inode && static_cast<uint64_t>(stamp.size) == header->source_size &&
+               static_cast<uint64_t>(stamp.mtime) == header->source_mtime &&
+               static_cast<uint64_t>(stamp.mtime_nsec) == header->source_mtime_nsec)
+            {
+                return true;
+            }
+            if(static_cast<uint64_t>(stamp.size) != header->source_size)
+            {
+                return false;
+            }
+            uint64_t hash = 0;
+            return ReadSource(input, &stamp, &hash) && hash == header->source_hash;
+        }
+    private:
+        //raw.txt的状态和内容的哈希
+        static bool ReadSource(const std::string& input, ns_util::FileUtil::FileStamp* stamp, uint64_t* hash)
+        {
+            if(!ns_util::FileUtil::GetFileStamp(input, stamp))
+            {
+                std::cerr << "stat file " << input << " failed!" << std::endl;
+                return false;
+            }
+            *hash = 0;
+            if(stamp->size == 0)
+            {
+                return true;
+            }
+            ns_util::MmapFile file;
+            if(!file.Open(input))
+            {
+                return false;
+            }
+            *hash = ns_util::HashUtil::XxHash64(file.Data(), file.Size());
+            return true;
+        }
+
+        boost::string_view GetString(uint64_t offset, uint32_t size) const
+        {
+            return boost::string_view(strings + offset, size);
+        }
+
+        std::shared_ptr<const ImpactList> DecodeImpacts(uint32_t term_id, ImpactOrder order) const
+        {
+            const TermRecord& record = terms[term_id];
+            std::shared_ptr<ImpactList> impacts = std::make_shared<ImpactList>(record.impact_count);
+            const uint8_t* p = impact_data + record.impact_offset + (order == IMPACT_BM25 ? record.impact_bm25_offset : 0);
+            for(ImpactEntry& entry : *impacts)
+            {
+                entry.doc_id = ns_util::VarintUtil::Decode(&p);
+                entry.title_tf = ns_util::VarintUtil::Decode(&p);
+                entry.content_tf = ns_util::VarintUtil::Decode(&p);
+            }
+            return impacts;
+        }
+
+        //[offset, offset + count * elem_size)在[0, size)之内，不会溢出
+        static bool InRange(uint64_t offset, uint64_t count, uint64_t elem_size, uint64_t size)
+        {
+            return offset <= size && count <= (size - offset) / elem_size;
+        }
+
+        //校验索引镜像：各段的大小和记录都在范围之内，访问正排、词典和跳表不会越界
+        //verify为true时还完整解码一遍全部的倒排块和impact列表：doc_id都小于doc_count，倒排块中严格递增且与跳表项一致，
+        //这样解码倒排时也不会越界；否则倒排数据的内容不做检查，加载时不需要读遍整个映射
+        static bool CheckImage(const char* base, size_t size, const std::string& name, bool verify)
+        {
+            const IndexHeader* h = reinterpret_cast<const IndexHeader*>(base);
+            if(size < sizeof(IndexHeader) || h->magic != INDEX_MAGIC)
+            {
+                std::cerr << name << " is not a valid index file" << std::endl;
+                return false;
+            }
+            if(h->version != INDEX_VERSION)
+            {
+                std::cerr << name << " index version " << h->version << " mismatch, expect " << INDEX_VERSION << std::endl;
+                return false;
+            }
+            if(h->doc_count > UINT32_MAX ||
+               !InRange(h->docs_offset, h->doc_count, sizeof(DocRecord), size) ||
+               !InRange(h->terms_offset, h->term_count, sizeof(TermRecord), size) ||
+               h->term_slot_count != TermSlotCount(h->term_count) ||
+               !InRange(h->term_slots_offset, h->term_slot_count, sizeof(TermSlot), size) ||
+               !InRange(h->blocks_offset, h->block_count, sizeof(BlockRecord), size) ||
+               !InRange(h->postings_offset, h->postings_size, 1, size) ||
+               !InRange(h->impacts_offset, h->impacts_size, 1, size) ||
+               !InRange(h->strings_offset, h->strings_size, 1, size))
+            {
+                std::cerr << name << " is truncated" << std::endl;
+                return false;
+            }
+
+            const DocRecord* doc_records = reinterpret_cast<const DocRecord*>(base + h->docs_offset);
+            for(uint64_t i = 0; i < h->doc_count; ++i)
+            {
+                const DocRecord& record = doc_records[i];
+                if(!InRange(record.title_offset, record.title_size, 1, h->strings_size) ||
+                   !InRange(record.content_offset, record.content_size, 1, h->strings_size) ||
+                   !InRange(record.url_offset, record.url_size, 1, h->strings_size))
+                {
+                    std::cerr << name << " has a broken doc record " << i << std::endl;
+                    return false;
+                }
+            }
+            const TermRecord* term_records = reinterpret_cast<const TermRecord*>(base + h->terms_offset);
+            const BlockRecord* block_records = reinterpret_cast<const BlockRecord*>(base + h->blocks_offset);
+            const uint8_t* postings = reinterpret_cast<const uint8_t*>(base + h->postings_offset);
+            for(uint64_t i = 0; i < h->term_count; ++i)
+            {
+                const TermRecord& record = term_records[i];
+                uint64_t term_blocks = (static_cast<uint64_t>(record.doc_freq) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+                if(!InRange(record.word_offset, record.word_size, 1, h->strings_size) ||
+                   !InRange(record.block_begin, term_blocks, 1, h->block_count) ||
+                   record.impact_count > record.doc_freq ||
+                   (record.impact_count > 0 && (record.impact_offset >= h->impacts_size ||
+                                                record.impact_bm25_offset >= h->impacts_size - record.impact_offset)))
+                {
+                    std::cerr << name << " has a broken term record " << i << std::endl;
+                    return false;
+                }
+                if(!verify)
+                {
+                    continue;
+                }
+                if(!CheckPostings(record, block_records, postings, h->postings_size, h->doc_count))
+                {
+                    std::cerr << name << " has broken postings for term " << i << std::endl;
+                    return false;
+                }
+                if(!CheckImpacts(record, reinterpret_cast<const uint8_t*>(base + h->impacts_offset), h->impacts_size, h->doc_count))
+                {
+                    std::cerr << name << " has a broken impact list for term " << i << std::endl;
+                    return false;
+                }
+            }
+            //哈希表中的term_id都有效，并且至少有一个空位，查找一定会结束
+            const TermSlot* slots = reinterpret_cast<const TermSlot*>(base + h->term_slots_offset);
+            uint64_t used_slots = 0;
+            for(uint64_t i = 0; i < h->term_slot_count; ++i)
+            {
+                if(slots[i].term > h->term_count)
+                {
+                    std::cerr << name << " has a broken term slot " << i << std::endl;
+                    return false;
+                }
+                used_slots += slots[i].term != 0;
+            }
+            if(used_slots != h->term_count)
+            {
+                std::cerr << name << " has a broken term hash table" << std::endl;
+                return false;
+            }
+            for(uint64_t i = 0; i < h->block_count; ++i)
+            {
+                if(block_records[i].offset >= h->postings_size || (i > 0 && block_records[i].offset <= block_records[i - 1].offset))
+                {
+                    std::cerr << name << " has a broken posting block " << i << std::endl;
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        //按DecodeImpacts的方式解码一个词的两种impact列表：varint不超出impact列表区，doc_id小于doc_count
+        static bool CheckImpacts(const TermRecord& record, const uint8_t* impacts, uint64_t impacts_size, uint64_t doc_count)
+        {
+            if(record.impact_count == 0)
+            {
+                return true;
+            }
+            const uint8_t* end = impacts + impacts_size;
+            const uint64_t starts[IMPACT_ORDER_COUNT] = {record.impact_offset, record.impact_offset + record.impact_bm25_offset};
+            uint32_t value = 0;
+            for(uint64_t start : starts)
+            {
+                const uint8_t* p = impacts + start;
+                for(uint32_t i = 0; i < record.impact_count; ++i)
+                {
+                    if(!ns_util::VarintUtil::DecodeChecked(&p, end, &value) || value >= doc_count ||
+                       !ns_util::VarintUtil::DecodeChecked(&p, end, &value) ||
+                       !ns_util::VarintUtil::DecodeChecked(&p, end, &value))
+                    {
+                        return false;
+                    }
+                }
+            }
+            return true;
+        }
+
+        //按PostingIterator::DecodeBlock的方式解码一个词的全部倒排块：varint不超出倒排数据区，
+        //doc_id严格递增且小于doc_count，每块最后一个doc_id等于跳表项的last_doc_id
+        static bool CheckPostings(const TermRecord& record, const BlockRecord* block_records, const uint8_t* postings,
+                                  uint64_t postings_size, uint64_t doc_count)
+        {
+            const uint8_t* end = postings + postings_size;
+            const BlockRecord* blocks = block_records + record.block_begin;
+            uint64_t prev_doc_id = 0;
+            uint32_t value = 0;
+            for(uint64_t b = 0; b * BLOCK_SIZE < record.doc_freq; ++b)
+            {
+                if(blocks[b].offset >= postings_size)
+                {
+                    return false;
+                }
+                const uint8_t* p = postings + blocks[b].offset;
+                uint64_t block_len = std::min<uint64_t>(BLOCK_SIZE, record.doc_freq - b * BLOCK_SIZE);
+                for(uint64_t i = 0; i < block_len; ++i)
+                {
+                    if(!ns_util::VarintUtil::DecodeChecked(&p, end, &value))
+                    {
+                        return false;
+                    }
+                    //只有整个拉链的第一个doc_id可以是0
+                    bool first = b == 0 && i == 0;
+                    if((!first && value == 0) || prev_doc_id + value >= doc_count)
+                    {
+                        return false;
+                    }
+                    prev_doc_id += value;
+                }
+                if(prev_doc_id != blocks[b].last_doc_id)
+                {
+                    return false;
+                }
+                //title和content的词频
+                for(uint64_t i = 0; i < block_len * 2; ++i)
+                {
+                    if(!ns_util::VarintUtil::DecodeChecked(&p, end, &value))
+                    {
+                        return false;
+                    }
+                }
+            }
+            return true;
+        }
+
+        //建立各段的指针，镜像必须已经通过CheckImage
+        void Attach(const char* base)
+        {
+            header = reinterpret_cast<const IndexHeader*>(base);
+            docs = reinterpret_cast<const DocRecord*>(base + header->docs_offset);
+            terms = reinterpret_cast<const TermRecord*>(base + header->terms_offset);
+            term_slots = reinterpret_cast<const TermSlot*>(base + header->term_slots_offset);
+            blocks = reinterpret_cast<const BlockRecord*>(base + header->blocks_offset);
+            posting_data = reinterpret_cast<const uint8_t*>(base + header->postings_offset);
+            impact_data = reinterpret_cast<const uint8_t*>(base + header->impacts_offset);
+            strings = base + header->strings_offset;
+            //解码后的数据属于旧镜像
+            pinned_postings.clear();
+            impact_terms.clear();
+            for(uint32_t term_id = 0; term_id < header->term_count; ++term_id)
+            {
+                if(terms[term_id].impact_count > 0)
+                {
+                    impact_terms.push_back(term_id);
+                }
+            }
+            ResetImpactSlots();
+        }
+
+        //清空全部解码后的impact列表，只能在发布之前调用
+        void ResetImpactSlots()
+        {
+            impact_slots.reset(new ImpactSlot[impact_terms.size() * IMPACT_ORDER_COUNT]);
+            std::lock_guard<std::mutex> lock(hot_mtx);
+            hot_clock.clear();
+            hot_hand = 0;
+        }
+
+        //term_id必须有impact列表
+        size_t ImpactSlotIndex(uint32_t term_id, ImpactOrder order) const
+        {
+            size_t i = std::lower_bound(impact_terms.begin(), impact_terms.end(), term_id) - impact_terms.begin();
+            return i * IMPACT_ORDER_COUNT + order;
+        }
+    };
+
+    inline bool IndexBuilder::AppendIndex(const Index& index, const std::vector<uint64_t>* deleted, std::vector<uint32_t>* remap)
+    {
+        const uint64_t doc_count = index.DocCount();
+        remap->assign(doc_count, UINT32_MAX);
+        for(uint64_t i = 0; i < doc_count; ++i)
+        {
+            if(deleted != nullptr && ((*deleted)[i / 64] >> (i % 64) & 1))
+            {
+                continue;
+            }
+            if(docs.size() >= UINT32_MAX)//doc_id以uint32_t保存
+            {
+                return false;
+            }
+            DocInfo info;
+            index.GetForwardIndex(i, &info);
+            BuildDoc doc;
+            doc.title = info.title.to_string();
+            doc.content = info.content.to_string();
+            doc.url = info.url.to_string();
+            index.GetDocLengths(i, &doc.title_length, &doc.content_length);
+            (*remap)[i] = static_cast<uint32_t>(docs.size());
+            docs.push_back(std::move(doc));
+        }
+
+        //新doc_id与旧doc_id的顺序一致，并且都排在已有文档之后，追加之后倒排拉链仍然有序
+        for(uint64_t term_id = 0; term_id < index.TermCount(); ++term_id)
+        {
+            BuildPostings* list = nullptr;
+            for(PostingIterator iter(index.GetInvertedList(term_id)); !iter.End(); iter.Next())
+            {
+                uint32_t doc_id = (*remap)[iter.DocId()];
+                if(doc_id == UINT32_MAX)
+                {
+                    continue;
+                }
+                if(list == nullptr)
+                {
+                    list = &postings[InternTerm(index.GetTerm(term_id))];
+                }
+                list->doc_ids.push_back(doc_id);
+                list->title_tfs.push_back(iter.TitleTf());
+                list->content_tfs.push_back(iter.ContentTf());
+            }
+        }
+        return true;
+    }
+}
@@ -0,0 +1,44 @@
+#include "index.hpp"
+
+//parser清洗后的数据
+const std::string input = "data/raw_html/raw.txt";
+//parser记录的raw.txt的变化，应用到索引文件之后删除
+const std::string delta = "data/raw_html/delta.txt";
+//生成的二进制索引文件，http_server启动时直接加载
+const std::string output = "data/raw_html/index.bin";
+
+int main()
+{
+    ns_index::Index index;
+
+    //第一步：有parser记录的变化时在原有的索引文件上应用变化，只对变化的文档分词；
+    //没有变化记录、没有可用的索引文件或者需要全部重建时，根据parser清洗后的数据建立正排、倒排索引
+    //delta.txt的第一行为"*"时raw.txt已经全部重新生成，不需要加载原有的索引文件
+    bool applied = false;
+    std::ifstream in(delta);
+    std::string first;
+    if (in.is_open() && std::getline(in, first) && first != "*")
+    {
+        //原有的索引文件要被复制到新索引中，完整校验一遍
+        ns_index::Index base;
+        applied = base.LoadIndex(output, true) && index.BuildIndex(base, delta, input);
+    }
+    in.close();
+    if (!applied && !index.BuildIndex(input))
+    {
+        std::cerr << "build index error!" << std::endl;
+        return 1;
+    }
+
+    //第二步：把索引保存为二进制文件
+    if (!index.SaveIndex(output))
+    {
+        std::cerr << "save index error!" << std::endl;
+        return 2;
+    }
+    //变化已经包含在新的索引文件中
+    unlink(delta.c_str());
+
+    LOG(NORMAL, "索引文件保存成功: " + output);
+    return 0;
+}
@@ -13,6 +13,8 @@
 
 void log(std::string level, std::string message, std::string file, int line)
 {
-    std::cout << "[" << level << "]" << "[" << time(nullptr) << "]" <<
-        "[" << message << "]" << "[" << file << ": " << line << "]" << std::endl;  
+    //先拼成一整行再输出，多个线程同时打日志时不会交错
+    std::string buffer = "[" + level + "]" + "[" + std::to_string(time(nullptr)) + "]" +
+        "[" + message + "]" + "[" + file + ": " + std::to_string(line) + "]\n";
+    std::cout << buffer << std::flush;
 }
\ No newline at end of file
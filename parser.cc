@@ -1,12 +1,41 @@
 #include <iostream>
 #include <string>
 #include <vector>
+#include <map>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <algorithm>
+#include <cstring>
+#include <cctype>
+#include <cstdint>
+#include <cstdlib>
+#include <cstdio>
+#include <strings.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 #include "util.hpp"
+#include "cppjieba/limonp/BlockingQueue.hpp"
+#include "cppjieba/limonp/BoundedBlockingQueue.hpp"
 #include <boost/filesystem.hpp>
 
 //是一个目录，下面放的是所有的html网页
 const std::string src_path = "data/input";
 const std::string output = "data/raw_html/raw.txt";
+//上一次解析时每个文件的状态、内容哈希，以及它在raw.txt中对应的那一行，文件没有变化时直接复用这一行
+const std::string manifest_path = "data/raw_html/manifest.txt";
+//相对于indexer上一次使用的raw.txt的变化，由indexer应用到索引文件上，应用之后删除
+//每行一条："+title\3content\3url"添加或更新文档，"-url"删除文档，"*"表示需要根据raw.txt重新建立索引
+//indexer执行之前多次执行parser时依次追加，同一个url以最后一条为准
+const std::string delta_path = "data/raw_html/delta.txt";
+//raw.txt的生成规则(去标签、实体、空白的处理，以及行格式)的版本，有变化时加1
+//manifest中记录的版本不同时上一次的输出不能复用，全部重新解析
+const unsigned PARSER_VERSION = 1;
 
 typedef struct DocInfo
 {
@@ -15,43 +44,422 @@ typedef struct DocInfo
     std::string url;     // 该文档在官网中的url
 } DocInfo_t;
 
+//manifest中的一个文件
+struct FileRecord
+{
+    ns_util::FileUtil::FileStamp stamp;
+    uint64_t hash;   // 文件内容的xxHash64
+    uint64_t offset; // 对应的一行在raw.txt中的位置
+    uint64_t length; // 这一行的长度(包括\n)，为0表示解析失败，没有输出
+
+    FileRecord()
+        :hash(0), offset(0), length(0)
+    {}
+};
+
+//上一次解析的结果：manifest和与它对应的raw.txt
+//manifest按路径排序，枚举线程按同样的顺序枚举文件，边枚举边逐行读取manifest，
+//找出每个文件上一次的记录以及已经删除的文件，内存占用与文件总数无关；raw.txt在解析期间只读
+struct PrevOutput
+{
+    bool loaded; // 为false时全部重新解析，也不记录变化
+    bool broken; // manifest中间有损坏的行，这一次记录的变化不完整，让indexer重新建立索引
+    std::ifstream manifest;
+    bool has_next; // next_path/next_record为manifest中下一个还没有对上的文件
+    std::string next_path;
+    FileRecord next_record;
+    ns_util::MmapFile raw;
+
+    PrevOutput()
+        :loaded(false), broken(false), has_next(false)
+    {}
+};
+
+//待处理的一个文件，以及它在上一次manifest中的记录
+struct FileTask
+{
+    std::string path;
+    bool known; // 上一次的manifest中有这个文件
+    FileRecord prev;
+
+    FileTask()
+        :known(false)
+    {}
+};
+
+//流水线中的一批文件：枚举线程按顺序编号，解析线程把结果按输出格式拼好，写线程按编号顺序写入
+//同时在处理的批数有上限，内存占用与文件总数无关
+const size_t FILES_PER_TASK = 64;
+
+struct ParseTask
+{
+    size_t seq;
+    std::vector<FileTask> files;
+    std::vector<FileRecord> records;//与files一一对应，offset为在output中的位置
+    std::string output;//这一批文件解析后的内容
+    std::string delta;//这一批文件的变化，以及枚举时发现的已经删除的文件
+    size_t parsed;//重新解析的文件数，其余的直接复用上一次的结果
+
+    explicit ParseTask(size_t n)
+        :seq(n), parsed(0)
+    {}
+};
+
 // const & :输入
 //* :输出
 //& :输入输出
 
-bool EnumFile(const std::string &src_path, std::vector<std::string> *files_list);
-bool ParseHtml(const std::vector<std::string> &files_list, std::vector<DocInfo_t> *results);
-bool SaveHtml(const std::vector<DocInfo_t> &results, const std::string &output);
+bool EnumFile(const std::string &src_path, const std::function<void(std::string &&)> &on_file);
+bool ParseHtml(const std::string &file_path, const std::string &html, DocInfo_t *doc);
+void SaveHtml(const DocInfo_t &doc, std::string *out);
+bool LoadManifest(const std::string &manifest_path, const std::string &output, PrevOutput *prev);
+bool NextManifestRecord(PrevOutput *prev);
+void ProcessFile(const FileTask &file, const PrevOutput &prev, ParseTask *task);
+bool ParseAll(const std::string &src_path, const std::string &output, size_t thread_num, bool full);
+
+int main(int argc, char *argv[])
+{
+    //默认只重新解析有变化的文件，--full忽略manifest全部重新解析
+    bool full = argc > 1 && std::string(argv[1]) == "--full";
+    //枚举文件、解析、写入三个阶段同时进行，解析使用全部的核
+    size_t thread_num = std::max<size_t>(1, std::thread::hardware_concurrency());
+    return ParseAll(src_path, output, thread_num, full) ? 0 : 1;
+}
 
-int main()
+//写临时文件再rename，中途失败不会留下写了一半的文件
+static bool ReplaceFile(const std::string &tmp, const std::string &path)
 {
-    std::vector<std::string> files_list;
-    //第一步：递归式的把每个html文件名带路径，保存到files_list中，方便后期进行一个一个的文件读取
-    if (!EnumFile(src_path, &files_list))
+    if (rename(tmp.c_str(), path.c_str()) != 0)
     {
-        std::cerr << "enum file name error!" << std::endl;
-        return 1;
+        std::cerr << "rename " << tmp << " to " << path << " failed!" << std::endl;
+        unlink(tmp.c_str());
+        return false;
     }
+    return true;
+}
+
+//raw.txt中一行的url字段
+static boost::string_view UrlOfLine(boost::string_view line)
+{
+    size_t sep = line.rfind('\3');
+    size_t end = line.size() - (!line.empty() && line.back() == '\n' ? 1 : 0);
+    return sep == boost::string_view::npos ? boost::string_view() : line.substr(sep + 1, end - sep - 1);
+}
+
+//manifest的第一行：parser的版本，raw.txt的inode、大小、修改时间，定宽，写完raw.txt之后原地改写
+static std::string StampLine(const ns_util::FileUtil::FileStamp &stamp)
+{
+    char line[128];
+    snprintf(line, sizeof(line), "%010u\t%020llu\t%020llu\t%020llu\t%020llu\n", PARSER_VERSION,
+             static_cast<unsigned long long>(stamp.inode), static_cast<unsigned long long>(stamp.size),
+             static_cast<unsigned long long>(stamp.mtime), static_cast<unsigned long long>(stamp.mtime_nsec));
+    return line;
+}
 
-    //第二步：按照files_list读取每个文件的内容，并进行解析
-    std::vector<DocInfo_t> results;
-    if (!ParseHtml(files_list, &results))
+//枚举线程 -> 有界队列 -> thread_num个解析线程 -> 按顺序写入output
+//有可用的manifest时只重新解析有变化的文件，变化追加到delta_path，最后更新manifest
+bool ParseAll(const std::string &src_path, const std::string &output, size_t thread_num, bool full)
+{
+    PrevOutput prev;
+    if (!full && !LoadManifest(manifest_path, output, &prev))
     {
-        std::cerr << "parse html error!" << std::endl;
-        return 2;
+        std::cerr << "manifest unavailable, parse all files" << std::endl;
     }
 
-    //第三步：把解析完毕的各个文件内容，写入到output，按照\3作为每个文档的分隔符
-    if (!SaveHtml(results, output))
+    //旧的raw.txt正在被映射，新的内容先写到临时文件
+    const std::string output_tmp = output + ".tmp";
+    std::ofstream out(output_tmp, std::ios::out | std::ios::binary);
+    if (!out.is_open())
     {
-        std::cerr << "save html error!" << std::endl;
-        return 3;
+        std::cerr << "open file " << output_tmp << " failed!" << std::endl;
+        return false;
+    }
+    //这一次的变化：先复制indexer还没有应用的变化，再追加新的变化
+    const std::string delta_tmp = delta_path + ".tmp";
+    std::ofstream delta_out;
+    if (prev.loaded)
+    {
+        delta_out.open(delta_tmp, std::ios::out | std::ios::binary);
+        std::string pending;
+        if (access(delta_path.c_str(), F_OK) == 0 && !ns_util::FileUtil::ReadFile(delta_path, &pending))
+        {
+            delta_out.setstate(std::ios::failbit);
+        }
+        delta_out.write(pending.data(), pending.size());
+        if (!delta_out)
+        {
+            std::cerr << "open file " << delta_tmp << " failed!" << std::endl;
+            out.close();
+            unlink(output_tmp.c_str());
+            return false;
+        }
     }
+    //新的manifest，写线程按枚举顺序(也就是路径顺序)逐行写入
+    const std::string manifest_tmp = manifest_path + ".tmp";
+    std::ofstream manifest_out(manifest_tmp, std::ios::out | std::ios::binary);
+    manifest_out << StampLine(ns_util::FileUtil::FileStamp());
+    size_t changes = 0;//这一次新增的变化条数
+    size_t output_size = 0;
+    size_t file_count = 0;
+    size_t parsed = 0;
 
-    return 0;
+    //待解析的批，空指针表示没有更多的批
+    limonp::BoundedBlockingQueue<std::shared_ptr<ParseTask> > tasks(thread_num * 2);
+    //解析完成、等待按顺序写入的批
+    std::map<size_t, std::shared_ptr<ParseTask> > done;
+    std::mutex done_mtx;
+    std::condition_variable done_cond;
+    size_t written = 0;//已经写入的批数
+    size_t task_count = 0;//枚举结束后为总批数
+    bool enum_finished = false;
+    bool enum_ok = true;
+    //同时在处理(排队、解析、等待写入)的批数上限，慢的批不会让后面完成的批无限堆积
+    const size_t max_pending = thread_num * 4;
+
+    //第一步：递归式的枚举每个html文件，按批交给解析线程
+    std::thread enumerator([&]()
+    {
+        size_t seq = 0;
+        std::shared_ptr<ParseTask> task = std::make_shared<ParseTask>(seq);
+        auto submit = [&]()
+        {
+            {
+                std::unique_lock<std::mutex> lock(done_mtx);
+                while (seq >= written + max_pending)
+                {
+                    done_cond.wait(lock);
+                }
+            }
+            tasks.Push(task);
+            task = std::make_shared<ParseTask>(++seq);
+        };
+        //上一次的manifest中排在path之前、这一次没有枚举到的文件已经删除，为nullptr时处理剩下的全部文件
+        auto skip_deleted = [&](const std::string *path)
+        {
+            while (prev.has_next && (path == nullptr || prev.next_path < *path))
+            {
+                if (prev.next_record.length > 0)
+                {
+                    boost::string_view line(prev.raw.Data() + prev.next_record.offset, prev.next_record.length);
+                    boost::string_view url = UrlOfLine(line);
+                    task->delta += '-';
+                    task->delta.append(url.data(), url.size());
+                    task->delta += '\n';
+                }
+                NextManifestRecord(&prev);
+            }
+        };
+        enum_ok = EnumFile(src_path, [&](std::string &&file_path)
+        {
+            skip_deleted(&file_path);
+            FileTask file;
+            if (prev.has_next && prev.next_path == file_path)
+            {
+                file.known = true;
+                file.prev = prev.next_record;
+                NextManifestRecord(&prev);
+            }
+            file.path = std::move(file_path);
+            task->files.push_back(std::move(file));
+            if (task->files.size() == FILES_PER_TASK)
+            {
+                submit();
+            }
+        });
+        skip_deleted(nullptr);
+        if (!task->files.empty() || !task->delta.empty())
+        {
+            submit();
+        }
+        for (size_t i = 0; i < thread_num; ++i)
+        {
+            tasks.Push(nullptr);
+        }
+        std::lock_guard<std::mutex> lock(done_mtx);
+        task_count = seq;
+        enum_finished = true;
+        done_cond.notify_all();
+    });
+
+    //第二步：读取每个文件的内容，并进行解析
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < thread_num; ++i)
+    {
+        workers.emplace_back([&]()
+        {
+            std::shared_ptr<ParseTask> task;
+            while ((task = tasks.Pop()) != nullptr)
+            {
+                for (const FileTask &file : task->files)
+                {
+                    ProcessFile(file, prev, task.get());
+                }
+
+                std::lock_guard<std::mutex> lock(done_mtx);
+                done[task->seq] = task;
+                done_cond.notify_all();
+            }
+        });
+    }
+
+    //第三步：按枚举的顺序把解析完毕的内容写入到output，按照\3作为每个文档的分隔符
+    //输出与逐个文件解析时完全相同，同时记下每个文件在output中的位置和这一批的变化
+    std::unique_lock<std::mutex> lock(done_mtx);
+    while (!enum_finished || written < task_count)
+    {
+        auto iter = done.find(written);
+        if (iter == done.end())
+        {
+            done_cond.wait(lock);
+            continue;
+        }
+        std::shared_ptr<ParseTask> task = iter->second;
+        done.erase(iter);
+        lock.unlock();
+        out.write(task->output.data(), task->output.size());
+        for (size_t i = 0; i < task->files.size(); ++i)
+        {
+            FileRecord &record = task->records[i];
+            record.offset += output_size;
+            manifest_out << task->files[i].path << '\t' << record.stamp.inode << '\t' << record.stamp.size << '\t'
+                         << record.stamp.mtime << '\t' << record.stamp.mtime_nsec << '\t' << record.hash << '\t'
+                         << record.offset << '\t' << record.length << '\n';
+        }
+        output_size += task->output.size();
+        file_count += task->files.size();
+        parsed += task->parsed;
+        if (prev.loaded)
+        {
+            delta_out.write(task->delta.data(), task->delta.size());
+            changes += std::count(task->delta.begin(), task->delta.end(), '\n');
+        }
+        lock.lock();
+        ++written;
+        done_cond.notify_all();
+    }
+    lock.unlock();
+
+    enumerator.join();
+    for (std::thread &worker : workers)
+    {
+        worker.join();
+    }
+    out.close();
+    if (!enum_ok || !out || !manifest_out)
+    {
+        std::cerr << (enum_ok ? "save html error!" : "enum file name error!") << std::endl;
+        unlink(output_tmp.c_str());
+        manifest_out.close();
+        unlink(manifest_tmp.c_str());
+        if (prev.loaded)
+        {
+            delta_out.close();
+            unlink(delta_tmp.c_str());
+        }
+        return false;
+    }
+
+    //第四步：记录变化；全部重新解析，或者manifest中途损坏、变化不完整时让indexer重新建立索引
+    bool rebuild = !prev.loaded || prev.broken;
+    if (rebuild)
+    {
+        delta_out.close();
+        delta_out.clear();
+        delta_out.open(delta_tmp, std::ios::out | std::ios::binary | std::ios::trunc);
+        delta_out << "*\n";
+    }
+    delta_out.close();
+    if (!delta_out)
+    {
+        std::cerr << "write file " << delta_tmp << " failed!" << std::endl;
+        unlink(delta_tmp.c_str());
+        unlink(output_tmp.c_str());
+        manifest_out.close();
+        unlink(manifest_tmp.c_str());
+        return false;
+    }
+    //先写变化，再替换raw.txt，最后更新manifest：中途退出时下一次执行要么重复记录同样的变化，
+    //要么发现raw.txt与manifest不一致而全部重新解析，indexer最终得到的索引都与raw.txt一致
+    if (!rebuild && changes == 0)
+    {
+        unlink(delta_tmp.c_str());
+    }
+    else if (!ReplaceFile(delta_tmp, delta_path))
+    {
+        unlink(output_tmp.c_str());
+        manifest_out.close();
+        unlink(manifest_tmp.c_str());
+        return false;
+    }
+    if (!ReplaceFile(output_tmp, output))
+    {
+        manifest_out.close();
+        unlink(manifest_tmp.c_str());
+        return false;
+    }
+
+    ns_util::FileUtil::FileStamp raw_stamp;
+    ns_util::FileUtil::GetFileStamp(output, &raw_stamp);
+    manifest_out.seekp(0);
+    manifest_out << StampLine(raw_stamp);
+    manifest_out.close();
+    if (!manifest_out)
+    {
+        //下一次执行时全部重新解析
+        std::cerr << "write file " << manifest_tmp << " failed!" << std::endl;
+        unlink(manifest_tmp.c_str());
+        unlink(manifest_path.c_str());
+        return false;
+    }
+    if (!ReplaceFile(manifest_tmp, manifest_path))
+    {
+        unlink(manifest_path.c_str());
+        return false;
+    }
+
+    LOG(NORMAL, "文件数: " + std::to_string(file_count) + ", 重新解析: " + std::to_string(parsed) +
+                ", 新增的变化: " + (rebuild ? std::string("全部") : std::to_string(changes)));
+    return true;
 }
 
-bool EnumFile(const std::string &src_path, std::vector<std::string> *files_list)
+//按路径的字节序枚举dir下的html文件：子目录按"名字/"与文件名一起排序，
+//这样递归得到的完整路径也是严格递增的，与manifest的顺序一致
+static void EnumDir(const boost::filesystem::path &dir, const std::function<void(std::string &&)> &on_file)
+{
+    namespace fs = boost::filesystem;
+    //排序用的名字，以及是否为目录
+    std::vector<std::pair<std::string, bool> > entries;
+    for (fs::directory_iterator iter(dir), end; iter != end; ++iter)
+    {
+        //与recursive_directory_iterator一样，不进入符号链接指向的目录
+        if (fs::is_directory(iter->symlink_status()))
+        {
+            entries.emplace_back(iter->path().filename().string() + '/', true);
+        }
+        //判断是否为普通文件，并且后缀为html，过滤掉其他类型的文件
+        else if (fs::is_regular_file(*iter) && iter->path().extension() == ".html")
+        {
+            entries.emplace_back(iter->path().filename().string(), false);
+        }
+    }
+    std::sort(entries.begin(), entries.end());
+    for (auto &entry : entries)
+    {
+        if (entry.second)
+        {
+            entry.first.pop_back();
+            EnumDir(dir / entry.first, on_file);
+        }
+        else
+        {
+            //当前路径一定是一个以html为后缀的普通文件
+            on_file(std::string((dir / entry.first).string()));
+        }
+    }
+}
+
+//on_file: 每找到一个html文件调用一次，参数为带路径的文件名，按路径顺序调用
+bool EnumFile(const std::string &src_path, const std::function<void(std::string &&)> &on_file)
 {
     namespace fs = boost::filesystem;
     fs::path root_path(src_path);
@@ -63,27 +471,301 @@ bool EnumFile(const std::string &src_path, std::vector<std::string> *files_list)
         return false;
     }
 
-    //定义一个空的迭代器，用来判断递归结束
-    fs::recursive_directory_iterator end;
-    for (fs::recursive_directory_iterator iter(root_path); iter != end; ++iter)
+    EnumDir(root_path, on_file);
+    return true;
+}
+
+//普通的文本字节：可以原样复制到输出中
+static inline bool IsPlainByte(char c)
+{
+    return static_cast<unsigned char>(c) > ' ' && c != '<' && c != '&';
+}
+
+//从p开始查找第一个需要特殊处理的字节：'<'、'&'、控制字符(< 0x20)，以及需要合并的空格，找不到时返回end
+//两个普通字节之间的单个空格合并之后还是它自己，当作普通字节一起复制，只有位于开头、结尾或者连续空白中的空格才停下
+//支持AVX2/SSE2时每次比较32/16个字节，剩下不足一组的字节逐个比较
+static const char *FindSpecial(const char *p, const char *end)
+{
+    //开头的空格要与之前的空白合并
+    if (p < end && *p == ' ')
+    {
+        return p;
+    }
+#if defined(__AVX2__)
+    const __m256i lt8 = _mm256_set1_epi8('<');
+    const __m256i amp8 = _mm256_set1_epi8('&');
+    const __m256i space8 = _mm256_set1_epi8(' ');
+    for (; end - p >= 32; p += 32)
+    {
+        __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+        __m256i hard = _mm256_or_si256(_mm256_cmpeq_epi8(chunk, lt8), _mm256_cmpeq_epi8(chunk, amp8));
+        //无符号比较chunk <= ' '：min(chunk, ' ') == chunk
+        hard = _mm256_or_si256(hard, _mm256_cmpeq_epi8(_mm256_min_epu8(chunk, space8), chunk));
+        unsigned hard_mask = _mm256_movemask_epi8(hard);
+        unsigned space_mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, space8));
+        //下一个字节不是普通字节的空格需要停下，这一组之后的字节单独判断
+        unsigned next_mask = (hard_mask >> 1) | (end - p == 32 || !IsPlainByte(p[32]) ? 1u << 31 : 0);
+        unsigned mask = (hard_mask & ~space_mask) | (space_mask & next_mask);
+        if (mask != 0)
+        {
+            return p + __builtin_ctz(mask);
+        }
+    }
+#endif
+#if defined(__SSE2__)
+    const __m128i lt = _mm_set1_epi8('<');
+    const __m128i amp = _mm_set1_epi8('&');
+    const __m128i space = _mm_set1_epi8(' ');
+    for (; end - p >= 16; p += 16)
+    {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+        __m128i hard = _mm_or_si128(_mm_cmpeq_epi8(chunk, lt), _mm_cmpeq_epi8(chunk, amp));
+        hard = _mm_or_si128(hard, _mm_cmpeq_epi8(_mm_min_epu8(chunk, space), chunk));
+        unsigned hard_mask = _mm_movemask_epi8(hard);
+        unsigned space_mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, space));
+        unsigned next_mask = (hard_mask >> 1) | (end - p == 16 || !IsPlainByte(p[16]) ? 1u << 15 : 0);
+        unsigned mask = (hard_mask & ~space_mask) | (space_mask & next_mask);
+        if (mask != 0)
+        {
+            return p + __builtin_ctz(mask);
+        }
+    }
+#endif
+    for (; p < end; ++p)
+    {
+        if (*p == ' ' ? p + 1 == end || !IsPlainByte(p[1]) : !IsPlainByte(*p))
+        {
+            return p;
+        }
+    }
+    return end;
+}
+
+//按UTF-8编码追加一个码点
+static void AppendUtf8(uint32_t cp, std::string *out)
+{
+    if (cp < 0x80)
+    {
+        out->push_back(static_cast<char>(cp));
+    }
+    else if (cp < 0x800)
+    {
+        out->push_back(static_cast<char>(0xC0 | (cp >> 6)));
+        out->push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+    }
+    else if (cp < 0x10000)
     {
-        //判断是否为普通文件，html是普通文件，过滤掉dir...
-        if (!fs::is_regular_file(*iter))
+        out->push_back(static_cast<char>(0xE0 | (cp >> 12)));
+        out->push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3F)));
+        out->push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+    }
+    else
+    {
+        out->push_back(static_cast<char>(0xF0 | (cp >> 18)));
+        out->push_back(static_cast<char>(0x80 | ((cp >> 12) & 0x3F)));
+        out->push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3F)));
+        out->push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+    }
+}
+
+//解析p处('&')开始的字符实体，成功时把码点写入cp并返回';'之后的位置，不是合法的实体时返回nullptr
+static const char *DecodeEntity(const char *p, const char *end, uint32_t *cp)
+{
+    //文档中常见的命名实体，其他的按原样保留
+    static const struct
+    {
+        const char *name;
+        uint32_t cp;
+    } entities[] = {
+        {"lt", '<'}, {"gt", '>'}, {"amp", '&'}, {"quot", '"'}, {"apos", '\''},
+        {"nbsp", 0xA0}, {"copy", 0xA9}, {"reg", 0xAE}, {"trade", 0x2122}, {"middot", 0xB7},
+        {"laquo", 0xAB}, {"raquo", 0xBB}, {"times", 0xD7}, {"ndash", 0x2013}, {"mdash", 0x2014},
+        {"lsquo", 0x2018}, {"rsquo", 0x2019}, {"ldquo", 0x201C}, {"rdquo", 0x201D}, {"hellip", 0x2026},
+    };
+    const size_t MAX_ENTITY = 10;
+    const char *limit = std::min(end, p + MAX_ENTITY + 2);
+    const char *semi = static_cast<const char *>(std::memchr(p, ';', limit - p));
+    if (semi == nullptr || semi - p < 2)
+    {
+        return nullptr;
+    }
+    const char *name = p + 1;
+    size_t len = semi - name;
+    if (name[0] == '#')
+    {
+        //数字实体：&#160; 或 &#xA0;
+        bool hex = len > 1 && (name[1] == 'x' || name[1] == 'X');
+        const char *digit = name + (hex ? 2 : 1);
+        if (digit == semi)
         {
-            continue;
+            return nullptr;
+        }
+        uint32_t value = 0;
+        for (; digit < semi; ++digit)
+        {
+            int d;
+            if (*digit >= '0' && *digit <= '9')
+            {
+                d = *digit - '0';
+            }
+            else if (hex && (*digit | 0x20) >= 'a' && (*digit | 0x20) <= 'f')
+            {
+                d = (*digit | 0x20) - 'a' + 10;
+            }
+            else
+            {
+                return nullptr;
+            }
+            value = value * (hex ? 16 : 10) + d;
+        }
+        if (value == 0 || value > 0x10FFFF || (value >= 0xD800 && value <= 0xDFFF))
+        {
+            return nullptr;
+        }
+        *cp = value;
+        return semi + 1;
+    }
+    for (const auto &entity : entities)
+    {
+        if (std::strlen(entity.name) == len && std::memcmp(entity.name, name, len) == 0)
+        {
+            *cp = entity.cp;
+            return semi + 1;
         }
+    }
+    return nullptr;
+}
+
+//'<'之后是字母、'/'、'!'或'?'时才是标签，否则按普通字符处理
+static bool IsTagStart(const char *p, const char *end)
+{
+    if (p + 1 >= end)
+    {
+        return false;
+    }
+    char c = p[1] | 0x20;
+    return (c >= 'a' && c <= 'z') || p[1] == '/' || p[1] == '!' || p[1] == '?';
+}
 
-        //判断文件的后缀是否为html，过滤掉其他类型的文件
-        if (iter->path().extension() != ".html")
+//提取[p, end)中的文本追加到out：解码字符实体，连续的空白合并成一个空格，'\n'和'\3'这类控制字符也当作空白，
+//这样输出中不会出现文档和字段的分隔符
+//space: 是否有尚未输出的空白，跨多段文本保持，首尾的空白不输出
+//stop_at_tag为true时遇到标签返回标签的起始位置，否则一直处理到end
+static const char *ExtractText(const char *p, const char *end, bool stop_at_tag, size_t start, std::string *out, bool *space)
+{
+    while (p < end)
+    {
+        const char *stop = FindSpecial(p, end);
+        if (stop != p)
+        {
+            if (*space && out->size() > start)
+            {
+                out->push_back(' ');
+            }
+            *space = false;
+            out->append(p, stop - p);
+        }
+        if (stop == end)
+        {
+            return end;
+        }
+        p = stop + 1;
+        uint32_t cp = static_cast<unsigned char>(*stop);
+        if (*stop == '<')
+        {
+            if (stop_at_tag && IsTagStart(stop, end))
+            {
+                return stop;
+            }
+        }
+        else if (*stop == '&')
+        {
+            const char *next = DecodeEntity(stop, end, &cp);
+            if (next != nullptr)
+            {
+                p = next;
+            }
+        }
+        if (cp <= ' ' || cp == 0xA0)
         {
+            *space = true;
             continue;
         }
+        if (*space && out->size() > start)
+        {
+            out->push_back(' ');
+        }
+        *space = false;
+        AppendUtf8(cp, out);
+    }
+    return end;
+}
 
-        // std::cout << "debug: "<< iter->path().string() << std::endl;
-        //当前路径一定是一个以html为后缀的普通文件
-        files_list->push_back(iter->path().string());
+//在[p, end)中不区分大小写地查找"</name"，找不到时返回end
+static const char *FindEndTag(const char *p, const char *end, const char *name, size_t len)
+{
+    while (p < end)
+    {
+        const char *open = static_cast<const char *>(std::memchr(p, '<', end - p));
+        if (open == nullptr)
+        {
+            break;
+        }
+        if (static_cast<size_t>(end - open) >= len + 2 && open[1] == '/' && strncasecmp(open + 2, name, len) == 0)
+        {
+            return open;
+        }
+        p = open + 1;
     }
-    return true;
+    return end;
+}
+
+//跳过p处('<')开始的标签，返回标签之后的位置
+//注释、<script>和<style>整块跳过；块级标签两侧的文本不应连在一起，当作一个空白
+static const char *SkipTag(const char *p, const char *end, bool *space)
+{
+    if (end - p >= 4 && std::memcmp(p, "<!--", 4) == 0)
+    {
+        const char *close = std::search(p + 4, end, "-->", "-->" + 3);
+        return close == end ? end : close + 3;
+    }
+    static const char *const block_tags[] = {
+        "p", "br", "div", "li", "ul", "ol", "dl", "dt", "dd", "td", "th", "tr", "table",
+        "h1", "h2", "h3", "h4", "h5", "h6", "pre", "hr", "blockquote", "title",
+    };
+    const char *name = p + 1;
+    bool closing = name < end && *name == '/';
+    if (closing)
+    {
+        ++name;
+    }
+    const char *name_end = name;
+    while (name_end < end && std::isalnum(static_cast<unsigned char>(*name_end)))
+    {
+        ++name_end;
+    }
+    size_t len = name_end - name;
+    const char *close = static_cast<const char *>(std::memchr(name_end, '>', end - name_end));
+    if (close == nullptr)
+    {
+        return end;
+    }
+    if (!closing && ((len == 6 && strncasecmp(name, "script", 6) == 0) || (len == 5 && strncasecmp(name, "style", 5) == 0)))
+    {
+        *space = true;
+        const char *end_tag = FindEndTag(close + 1, end, name, len);
+        close = static_cast<const char *>(std::memchr(end_tag, '>', end - end_tag));
+        return close == nullptr ? end : close + 1;
+    }
+    for (const char *tag : block_tags)
+    {
+        if (std::strlen(tag) == len && strncasecmp(tag, name, len) == 0)
+        {
+            *space = true;
+            break;
+        }
+    }
+    return close + 1;
 }
 
 static bool ParseTitle(const std::string &file, std::string *title)
@@ -105,41 +787,27 @@ static bool ParseTitle(const std::string &file, std::string *title)
         return false;
     }
 
-    *title = file.substr(begin, end - begin);
+    //标题同样需要解码实体、合并空白，\n是输出中文档的分隔符
+    title->clear();
+    bool space = false;
+    ExtractText(file.data() + begin, file.data() + end, false, 0, title, &space);
     return true;
 }
 
+//提取正文：一遍扫描完成去标签、跳过注释/脚本/样式、解码实体和合并空白
 static bool ParseContent(const std::string &file, std::string *content)
 {
-    //去标签，基于一个简易的状态机
-    enum status
+    const char *p = file.data();
+    const char *end = p + file.size();
+    size_t start = content->size();
+    bool space = false;
+    content->reserve(start + file.size());
+    while (p < end)
     {
-        LABLE,
-        CONTENT
-    };
-
-    status s = LABLE;
-    for (char c : file)
-    {
-        switch (s)
+        p = ExtractText(p, end, true, start, content, &space);
+        if (p < end)
         {
-        case LABLE:
-            if (c == '>')
-                s = CONTENT;
-            break;
-        case CONTENT:
-            if (c == '<')
-                s = LABLE;
-            else
-            {
-                //我们不想保留原始文件中的\n，因为我们想用\n作为html解析之后文本的分隔符
-                if (c == '\n')
-                    c = ' ';
-                content->push_back(c);
-            }
-            break;
-        default:
-            break;
+            p = SkipTag(p, end, &space);
         }
     }
     return true;
@@ -161,68 +829,215 @@ static bool ParseUrl(const std::string &file_path, std::string *url)
 //     std::cout << "url: " << doc.url << std::endl;
 // }
 
-bool ParseHtml(const std::vector<std::string> &files_list, std::vector<DocInfo_t> *results)
+//解析一个文件，html为文件的内容，失败时跳过这个文件
+bool ParseHtml(const std::string &file_path, const std::string &result, DocInfo_t *doc)
 {
-    for (const std::string &file_path : files_list)
+    // 1.文件已经由调用者读入
+    // 2.解析文件，提取title
+    if (!ParseTitle(result, &doc->title))
     {
-        // 1.读取文件，Read()
-        std::string result;
-        if (!ns_util::FileUtil::ReadFile(file_path, &result))
-        {
-            continue;
-        }
-        DocInfo_t doc;
-        // 2.解析文件，提取title
-        if (!ParseTitle(result, &doc.title))
+        return false;
+    }
+    // 3.解析文件，提取content
+    if (!ParseContent(result, &doc->content))
+    {
+        return false;
+    }
+    // 4.解析文件路径，构建url
+    if (!ParseUrl(file_path, &doc->url))
+    {
+        return false;
+    }
+
+    // done，一定是完成了解析任务，当前文件的相关结果都保存在doc里
+    // for debug
+    // ShowDoc(*doc);
+    return true;
+}
+
+// title/3content/3url /n title/3content/3url /n ...
+//把doc按照输出格式追加到out
+void SaveHtml(const DocInfo_t &doc, std::string *out)
+{
+#define SEP '\3'
+    *out += doc.title;
+    *out += SEP;
+    *out += doc.content;
+    *out += SEP;
+    *out += doc.url;
+    *out += '\n';
+}
+static bool ParseNumber(const std::string &field, uint64_t *value)
+{
+    if (field.empty() || field.size() > 20 || field.find_first_not_of("0123456789") != std::string::npos)
+    {
+        return false;
+    }
+    *value = std::strtoull(field.c_str(), nullptr, 10);
+    return true;
+}
+
+//打开上一次的manifest，并映射与它对应的raw.txt；raw.txt在这之后被修改过时不可用
+bool LoadManifest(const std::string &manifest_path, const std::string &output, PrevOutput *prev)
+{
+    if (access(manifest_path.c_str(), F_OK) != 0)
+    {
+        return false;
+    }
+    prev->manifest.open(manifest_path, std::ios::in | std::ios::binary);
+    std::string line;
+    if (!prev->manifest.is_open() || !std::getline(prev->manifest, line))
+    {
+        return false;
+    }
+
+    //第一行：parser的版本，raw.txt的inode、大小、修改时间
+    std::vector<std::string> fields;
+    ns_util::StringUtil::CutString(line, &fields, "\t");
+    uint64_t values[5];
+    ns_util::FileUtil::FileStamp expected, actual;
+    if (fields.size() != 5 || !ParseNumber(fields[0], &values[0]) || !ParseNumber(fields[1], &values[1]) ||
+        !ParseNumber(fields[2], &values[2]) || !ParseNumber(fields[3], &values[3]) || !ParseNumber(fields[4], &values[4]))
+    {
+        std::cerr << "bad manifest " << manifest_path << std::endl;
+        return false;
+    }
+    if (values[0] != PARSER_VERSION)
+    {
+        std::cerr << manifest_path << " was written by parser version " << values[0] << ", current version is "
+                  << PARSER_VERSION << std::endl;
+        return false;
+    }
+    expected.inode = values[1];
+    expected.size = values[2];
+    expected.mtime = values[3];
+    expected.mtime_nsec = values[4];
+    if (!ns_util::FileUtil::GetFileStamp(output, &actual) || !(actual == expected))
+    {
+        std::cerr << output << " changed since the last run" << std::endl;
+        return false;
+    }
+    //raw.txt为空时没有可以复用的内容
+    if (actual.size > 0 && !prev->raw.Open(output))
+    {
+        return false;
+    }
+    prev->loaded = true;
+    NextManifestRecord(prev);
+    return true;
+}
+
+//读取manifest中的下一个文件：path inode size mtime mtime_nsec hash offset length，路径严格递增
+//读完或者遇到损坏的行时返回false，损坏时之后的文件都当作新文件重新解析
+bool NextManifestRecord(PrevOutput *prev)
+{
+    prev->has_next = false;
+    std::string line;
+    std::vector<std::string> fields;
+    while (std::getline(prev->manifest, line))
+    {
+        if (line.empty())
         {
             continue;
         }
-        // 3.解析文件，提取content
-        if (!ParseContent(result, &doc.content))
+        ns_util::StringUtil::CutString(line, &fields, "\t");
+        uint64_t values[7];
+        bool ok = fields.size() == 8 && fields[0] > prev->next_path;
+        for (size_t j = 0; ok && j < 7; ++j)
         {
-            continue;
+            ok = ParseNumber(fields[j + 1], &values[j]);
         }
-        // 4.解析文件路径，构建url
-        if (!ParseUrl(file_path, &doc.url))
+        if (!ok || values[5] > prev->raw.Size() || values[6] > prev->raw.Size() - values[5])
         {
-            continue;
+            std::cerr << "bad manifest line: " << line.substr(0, 128) << std::endl;
+            prev->broken = true;
+            return false;
         }
-
-        // done，一定是完成了解析任务，当前文件的相关结果都保存在doc里
-        results->push_back(std::move(doc));
-
-        // for debug
-        // ShowDoc(doc);
-        // break;
+        prev->next_path = std::move(fields[0]);
+        FileRecord &record = prev->next_record;
+        record.stamp.inode = values[0];
+        record.stamp.size = values[1];
+        record.stamp.mtime = values[2];
+        record.stamp.mtime_nsec = values[3];
+        record.hash = values[4];
+        record.offset = values[5];
+        record.length = values[6];
+        prev->has_next = true;
+        return true;
     }
-    return true;
+    return false;
 }
 
-// title/3content/3url /n title/3content/3url /n ...
-bool SaveHtml(const std::vector<DocInfo_t> &results, const std::string &output)
+//处理一个文件，结果追加到task：状态或者内容没有变化时复用上一次raw.txt中的那一行，否则重新解析，
+//与上一次不同时把变化记录到task->delta
+void ProcessFile(const FileTask &file, const PrevOutput &prev, ParseTask *task)
 {
-#define SEP '\3'
-    std::ofstream out(output, std::ios::out | std::ios::binary);
-    if(!out.is_open())
+    const std::string &file_path = file.path;
+    //每个线程反复使用同一个缓冲区
+    static thread_local std::string html;
+    FileRecord record;
+    record.offset = task->output.size();
+
+    const FileRecord *old = nullptr;
+    boost::string_view old_line;
+    if (file.known)
     {
-        std::cerr << "open file " << output << " failed!" << std::endl;
-        return false;
+        old = &file.prev;
+        old_line = boost::string_view(prev.raw.Data() + old->offset, old->length);
     }
 
-    //进行文件内容的写入
-    for(auto& doc : results)
+    bool same = false;
+    if (ns_util::FileUtil::GetFileStamp(file_path, &record.stamp))
     {
-        std::string out_string;
-        out_string += doc.title;
-        out_string += SEP;
-        out_string += doc.content;
-        out_string += SEP;
-        out_string += doc.url;
-        out_string += '\n';
-
-        out.write(out_string.c_str(), out_string.size());
+        if (old != nullptr && old->stamp == record.stamp)
+        {
+            //状态没有变化，不需要读文件
+            record.hash = old->hash;
+            same = true;
+        }
+        else if (ns_util::FileUtil::ReadFile(file_path, &html))
+        {
+            //比如重新下载了一遍，修改时间变了，内容相同
+            record.hash = ns_util::HashUtil::XxHash64(html.data(), html.size());
+            same = old != nullptr && old->hash == record.hash;
+            if (!same)
+            {
+                DocInfo_t doc;
+                if (ParseHtml(file_path, html, &doc))
+                {
+                    SaveHtml(doc, &task->output);
+                }
+                ++task->parsed;
+            }
+        }
+    }
+    if (same)
+    {
+        task->output.append(old_line.data(), old_line.size());
     }
+    record.length = task->output.size() - record.offset;
+    task->records.push_back(record);
 
-    out.close();
-    return true;
-}
\ No newline at end of file
+    if (!prev.loaded || same)
+    {
+        return;
+    }
+    boost::string_view line(task->output.data() + record.offset, record.length);
+    if (line == old_line)
+    {
+        return;
+    }
+    if (!line.empty())
+    {
+        task->delta += '+';
+        task->delta.append(line.data(), line.size());
+    }
+    else
+    {
+        //解析失败或者文件已经不在了，之前的版本要从索引中删除
+        task->delta += '-';
+        boost::string_view url = UrlOfLine(old_line);
+        task->delta.append(url.data(), url.size());
+        task->delta += '\n';
+    }
+}
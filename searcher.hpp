@@ -1,102 +1,448 @@
 #pragma once
 
 #include "index.hpp"
+#include "segment.hpp"
 #include "util.hpp"
 #include "log.hpp"
+#include "cache.hpp"
 #include <algorithm>
+#include <cstdio>
+#include <cmath>
+#include <memory>
+#include <atomic>
+#include <thread>
 #include <jsoncpp/json/json.h>
 
 namespace ns_searcher
 {
+    //打分方式：RANK_WEIGHT为title/content词频的加权和，RANK_BM25为BM25F
+    enum RankMode
+    {
+        RANK_WEIGHT,
+        RANK_BM25
+    };
+
+    //一次搜索请求的分页及打分参数
+    struct SearchOptions
+    {
+        size_t start;//跳过相关性最高的前start个结果
+        size_t count;//本次最多返回的结果个数
+        //游标分页：只返回排在(after_score, after_id)之后的结果，此时start只表示这一页第一个结果的排名
+        bool use_cursor;
+        double after_score;
+        uint64_t after_id;
+        //需要精确的命中总数时逐个累加全部倒排拉链，否则使用WAND剪枝，total可能只是下界
+        bool exact_total;
+        RankMode rank;
+
+        SearchOptions()
+            :start(0), count(10), use_cursor(false), after_score(0), after_id(0), exact_total(false), rank(RANK_WEIGHT)
+        {}
+    };
+
+    //查询结果缓存默认的内存预算
+    const size_t DEFAULT_CACHE_BYTES = 64 << 20;
+
     class Searcher
     {
     private:
-        ns_index::Index* index;
+        //索引的各个段，查询开始时取一份快照，之后即使发布了新快照也在旧快照上完成
+        //旧快照在最后一个引用它的查询结束后自动释放
+        ns_index::SegmentManager segments;
+
+        std::string index_file;
+        std::string input;
+        std::mutex reload_mtx;//同一时刻只有一个线程在建立或加载新快照
+        std::atomic<bool> rebuilding;
+        std::thread rebuild_thread;//后台重建索引的线程，析构时等待它结束
+        ns_util::FileUtil::FileStamp loaded_stamp;//当前快照对应的索引文件
+        //查询结果缓存：key为规范化后的分词结果和分页参数，value为最终的json串
+        //条目带有快照的版本号，发布新快照(重建、增量更新、合并)之后旧的结果全部失效
+        mutable ns_util::TinyLfuCache cache;
+        size_t pinned_terms;//加载或建立索引之后常驻内存的高频词个数
     public:
-        Searcher(){}
-        ~Searcher(){}
+        //cache_bytes: 查询结果缓存的内存预算，为0时不缓存
+        //pinned_terms: 文档频率最高的多少个词预先解码并常驻内存
+        explicit Searcher(size_t cache_bytes = DEFAULT_CACHE_BYTES, size_t pinned_terms = 0)
+            :rebuilding(false), cache(cache_bytes), pinned_terms(pinned_terms)
+        {}
+        ~Searcher()
+        {
+            //重建线程访问this，必须在成员析构之前结束
+            if(rebuild_thread.joinable())
+            {
+                rebuild_thread.join();
+            }
+        }
     public:
-        void InitSearcher(const std::string& input)
+        //index_file: indexer预先生成的二进制索引文件
+        //input: parser清洗后的数据，索引文件不可用或者与input不一致时才重新分词建立索引
+        void InitSearcher(const std::string& index_file, const std::string& input)
+        {
+            this->index_file = index_file;
+            this->input = input;
+            std::lock_guard<std::mutex> lock(reload_mtx);
+            //优先加载索引文件，失败或者索引文件已经过期再根据原始数据建立索引
+            if(LoadSnapshot(true))
+            {
+                LOG(NORMAL, "加载索引文件成功...");
+                return;
+            }
+            LOG(WARNING, "索引文件不可用，重新建立索引...");
+            if(BuildSnapshot(0))
+            {
+                LOG(NORMAL, "建立正排、倒排索引成功...");
+            }
+        }
+
+        //在后台线程根据原始数据重新建立索引，完成后替换当前快照，查询不会被阻塞
+        //已经有重建在进行时返回false
+        bool StartRebuild()
         {
-            //1.获取或者创建index对象
-            index = ns_index::Index::GetInstance();
-            //std::cout << "获取index单例成功..." << std::endl;//for debug
-            LOG(NORMAL, "获取index单例成功...");
-            //2.根据index对象建立索引
-            index->BuildIndex(input);
-            // std::cout << "建立索引成功..." << std::endl;//for debug
-            LOG(NORMAL, "建立正排、倒排索引成功...");
+            if(rebuilding.exchange(true))
+            {
+                return false;
+            }
+            //上一次的重建已经结束(rebuilding为false)，回收它的线程
+            if(rebuild_thread.joinable())
+            {
+                rebuild_thread.join();
+            }
+            rebuild_thread = std::thread([this]()
+            {
+                LOG(NORMAL, "开始重新建立索引...");
+                {
+                    std::lock_guard<std::mutex> lock(reload_mtx);
+                    //留一半的核继续处理查询
+                    if(BuildSnapshot(std::max<size_t>(1, std::thread::hardware_concurrency() / 2)))
+                    {
+                        LOG(NORMAL, "重新建立索引成功...");
+                    }
+                }
+                rebuilding = false;
+            });
+            return true;
+        }
+
+        //索引文件被替换(比如重新执行了indexer)时加载新的索引文件，返回是否发布了新快照
+        bool ReloadIfChanged()
+        {
+            //持有锁之后再检查，重建过程中保存的索引文件不会被重复加载
+            std::lock_guard<std::mutex> lock(reload_mtx);
+            ns_util::FileUtil::FileStamp stamp;
+            if(!ns_util::FileUtil::GetFileStamp(index_file, &stamp) || stamp == loaded_stamp)
+            {
+                return false;
+            }
+            if(!LoadSnapshot())
+            {
+                //文件有问题时记下来，不反复加载同一个文件
+                loaded_stamp = stamp;
+                return false;
+            }
+            LOG(NORMAL, "索引文件已更新，加载新的索引成功...");
+            return true;
+        }
+
+        //增量更新：新文档先进入内存，Flush之后可以被搜索到；url已经存在时作为更新
+        bool AddDocument(const std::string& title, const std::string& content, const std::string& url)
+        {
+            //字段中不能出现raw.txt的分隔符
+            if(url.empty() || (title + content + url).find_first_of("\3\n") != std::string::npos)
+            {
+                return false;
+            }
+            return segments.AddDocument(title + "\3" + content + "\3" + url);
+        }
+
+        //增量更新：删除url对应的文档，立即生效
+        bool DeleteDocument(const std::string& url)
+        {
+            return segments.DeleteDocument(url);
+        }
+
+        //把内存中的新文档刷成段，使其可以被搜索到
+        bool Flush()
+        {
+            return segments.Flush();
+        }
+
+        //索引各个段的状态和后台合并的统计信息
+        void GetStats(std::string* json_string)
+        {
+            std::shared_ptr<const ns_index::IndexSnapshot> snapshot = segments.Snapshot();
+            ns_index::MergeStats stats = segments.GetMergeStats();
+            Json::Value root;
+            root["docs"] = static_cast<Json::UInt64>(snapshot->DocCount());
+            root["live_docs"] = static_cast<Json::UInt64>(snapshot->LiveCount());
+            Json::Value segment_list(Json::arrayValue);
+            for(const ns_index::SegmentView& view : snapshot->Segments())
+            {
+                Json::Value item;
+                item["docs"] = static_cast<Json::UInt64>(view.DocCount());
+                item["deleted"] = static_cast<Json::UInt64>(view.deleted_count);
+                item["bytes"] = static_cast<Json::UInt64>(view.GetIndex().ImageSize());
+                segment_list.append(item);
+            }
+            root["segments"] = segment_list;
+
+            Json::Value merge;
+            merge["merges"] = static_cast<Json::UInt64>(stats.merges);
+            merge["forced_merges"] = static_cast<Json::UInt64>(stats.forced_merges);
+            merge["aborted_merges"] = static_cast<Json::UInt64>(stats.aborted_merges);
+            merge["segments_merged"] = static_cast<Json::UInt64>(stats.segments_merged);
+            merge["docs_merged"] = static_cast<Json::UInt64>(stats.docs_merged);
+            merge["deleted_docs_purged"] = static_cast<Json::UInt64>(stats.deleted_docs_purged);
+            merge["bytes_written"] = static_cast<Json::UInt64>(stats.bytes_written);
+            merge["merge_millis"] = static_cast<Json::UInt64>(stats.merge_millis);
+            merge["running"] = static_cast<Json::UInt64>(stats.running);
+            merge["flush_stalls"] = static_cast<Json::UInt64>(stats.flush_stalls);
+            root["merge"] = merge;
+
+            ns_util::CacheStats cache_stats = cache.GetStats();
+            Json::Value cache_item;
+            cache_item["hits"] = static_cast<Json::UInt64>(cache_stats.hits);
+            cache_item["misses"] = static_cast<Json::UInt64>(cache_stats.misses);
+            cache_item["rejected"] = static_cast<Json::UInt64>(cache_stats.rejected);
+            cache_item["evictions"] = static_cast<Json::UInt64>(cache_stats.evictions);
+            cache_item["entries"] = static_cast<Json::UInt64>(cache_stats.entries);
+            cache_item["bytes"] = static_cast<Json::UInt64>(cache_stats.bytes);
+            root["cache"] = cache_item;
+
+            ns_index::HotTermStats hot_stats;
+            for(const ns_index::SegmentView& view : snapshot->Segments())
+            {
+                ns_index::HotTermStats segment_stats = view.GetIndex().GetHotTermStats();
+                hot_stats.hits += segment_stats.hits;
+                hot_stats.misses += segment_stats.misses;
+                hot_stats.cached += segment_stats.cached;
+                hot_stats.pinned += segment_stats.pinned;
+            }
+            Json::Value hot_item;
+            hot_item["hits"] = static_cast<Json::UInt64>(hot_stats.hits);
+            hot_item["misses"] = static_cast<Json::UInt64>(hot_stats.misses);
+            hot_item["cached"] = static_cast<Json::UInt64>(hot_stats.cached);
+            hot_item["pinned"] = static_cast<Json::UInt64>(hot_stats.pinned);
+            root["hot_terms"] = hot_item;
+
+            Json::FastWriter writer;
+            *json_string = writer.write(root);
         }
 
         struct InvertedElemPrint
         {
             uint64_t id;
-            int weight;
-            std::vector<std::string> words;
+            double score;
+            uint64_t term_mask;//命中的词，第i位表示查询中第i个词命中
 
             InvertedElemPrint()
-                :id(0),weight(0)
+                :id(0),score(0),term_mask(0)
             {}
         };
 
+        //一个查询最多使用的词数，与term_mask的位数一致
+        static const size_t MAX_QUERY_TERMS = 64;
+
+        //按doc_id下标的稠密累加器，代替哈希表，每个线程一份反复使用
+        //查询结束时只清理本次触碰过的位置，不需要每次清空整个数组
+        struct ScoreAccumulator
+        {
+            std::vector<double> scores;
+            std::vector<uint64_t> term_masks;
+            std::vector<uint32_t> touched;//本次查询命中的doc_id
+
+            void Reset(size_t doc_count)
+            {
+                for(uint32_t doc_id : touched)
+                {
+                    scores[doc_id] = 0;
+                    term_masks[doc_id] = 0;
+                }
+                touched.clear();
+                if(scores.size() < doc_count)
+                {
+                    scores.resize(doc_count, 0);
+                    term_masks.resize(doc_count, 0);
+                }
+            }
+        };
+
+        //查询中的一个词在某个段中的倒排拉链
+        struct QueryTerm
+        {
+            size_t query_pos;//在查询中的位置，对应term_mask中的一位
+            uint32_t term_id;//在所在段中的term_id
+            ns_index::InvertedList list;
+            uint64_t live_doc_freq;//倒排拉链中未删除的文档数
+            //BM25打分使用，idf和平均长度都按整个快照中未删除的文档统计，不同段中的分数可以直接比较
+            double idf;
+            ns_index::Bm25Averages averages;
+            //段内的BM25上界(max_bm25、impact列表中的LocalBm25Tf)不含idf，并且是按段内的平均长度计算的，
+            //乘以bound_scale换算成按整个快照计算的分数上界
+            double bound_scale;
+            double max_score;//按所选打分方式，整个倒排拉链中最大的分数
+        };
+
+        //游标格式：下一页第一个结果的排名_上一页最后一个结果的分数_doc_id，对用户是不透明的
+        //分数按%.17g输出，解析回来与原值完全相同
+        static std::string MakeCursor(size_t next_start, const InvertedElemPrint& last)
+        {
+            char buffer[128];
+            snprintf(buffer, sizeof(buffer), "%zu_%.17g_%llu", next_start, last.score,
+                     static_cast<unsigned long long>(last.id));
+            return buffer;
+        }
+
+        static bool ParseCursor(const std::string& cursor, SearchOptions* options)
+        {
+            unsigned long long next_start = 0;
+            double score = 0;
+            unsigned long long id = 0;
+            char tail = 0;
+            if(sscanf(cursor.c_str(), "%llu_%lf_%llu%c", &next_start, &score, &id, &tail) != 3 || !std::isfinite(score))
+            {
+                return false;
+            }
+            options->use_cursor = true;
+            options->start = next_start;
+            options->after_score = score;
+            options->after_id = id;
+            return true;
+        }
+
+        //查询结果缓存的key：规范化后的词，加上影响结果的全部参数
+        static std::string MakeCacheKey(const std::vector<std::string>& words, const SearchOptions& options)
+        {
+            std::string key;
+            for(const std::string& word : words)
+            {
+                key += word;
+                key += '\x1f';
+            }
+            char buffer[160];
+            snprintf(buffer, sizeof(buffer), "\x1e%zu_%zu_%d_%.17g_%llu_%d_%d", options.start, options.count,
+                     options.use_cursor ? 1 : 0, options.after_score, static_cast<unsigned long long>(options.after_id),
+                     options.exact_total ? 1 : 0, static_cast<int>(options.rank));
+            key += buffer;
+            return key;
+        }
+
         //query: 搜索关键字
-        //json_string: 返回给用户浏览器的结果
-        void Search(const std::string& query, std::string* json_string)
+        //json_string: 返回给用户浏览器的结果，包括命中总数total、这一页的结果results和下一页的游标cursor
+        //options: 分页参数，只为返回的这一页结果构建摘要和json
+        //查询过程中只修改内部加锁的结果缓存，多个线程可以同时调用
+        void Search(const std::string& query, std::string* json_string, const SearchOptions& options = SearchOptions()) const
         {
-            //1.分词：对用户传来的query语句进行分词
+            //0.取当前的索引快照，本次查询都在这份快照上进行
+            std::shared_ptr<const ns_index::IndexSnapshot> snapshot = segments.Snapshot();
+            const std::vector<ns_index::SegmentView>& views = snapshot->Segments();
+            //1.分词：对用户传来的query语句进行分词并转为小写，重复的查询直接使用缓存的分词结果
             std::vector<std::string> words;
-            ns_util::JiebaUtil::WordSegmentation(query, &words);
-            //2.触发：根据分完的各个词，进行index查找
-            //ns_index::InvertedList inverted_list_all;
-            
-            std::unordered_map<uint64_t, InvertedElemPrint> tokens_map;
-            std::vector<InvertedElemPrint> inverted_list_all;
-            for(std::string word : words)
+            ns_util::JiebaUtil::QuerySegmentation(query, &words);
+            //同一份快照上相同的查询结果相同，命中缓存时直接返回
+            const std::string cache_key = MakeCacheKey(words, options);
+            if(cache.Get(cache_key, snapshot->Version(), json_string))
             {
-                boost::to_lower(word);
-
-                //获取分词的倒排拉链
-                ns_index::InvertedList* inverted_list = index->GetInvertedList(word);
-                if(nullptr == inverted_list)
+                return;
+            }
+            //2.触发：根据分完的各个词，在每个段中查找，获取每个词的倒排拉链
+            std::vector<std::string> query_words;//至少在一个段中出现的词
+            std::vector<std::vector<QueryTerm> > terms(views.size());//每个段中的查询词
+            const ns_index::Bm25Averages& averages = snapshot->Averages();
+            for(const std::string& word : words)
+            {
+                const size_t query_pos = query_words.size();
+                uint64_t doc_freq = 0;
+                uint64_t live_doc_freq = 0;
+                for(size_t i = 0; i < views.size(); ++i)
+                {
+                    uint32_t term_id = 0;
+                    if(!views[i].GetIndex().FindTerm(word, &term_id))
+                    {
+                        continue;
+                    }
+                    QueryTerm term;
+                    term.query_pos = query_pos;
+                    term.term_id = term_id;
+                    term.list = views[i].GetIndex().GetInvertedList(term_id);
+                    term.live_doc_freq = views[i].LiveDocFreq(term.list);
+                    doc_freq += term.list.size();
+                    live_doc_freq += term.live_doc_freq;
+                    terms[i].push_back(term);
+                }
+                if(doc_freq == 0)
                 {
                     continue;
                 }
-                //将倒排拉链中的倒排元素汇总的放入到一个数组中
-                //需要将doc_id相同的elem合并
-                //inverted_list_all.insert(inverted_list_all.end(), inverted_list->begin(), inverted_list->end());
-                //去重
-                for(const auto& elem : *inverted_list)
+                query_words.push_back(word);
+
+                //idf按整个快照中未删除的文档统计，已删除的文档不影响分数
+                double idf = ns_index::Bm25Idf(snapshot->LiveCount(), live_doc_freq);
+                for(size_t i = 0; i < views.size(); ++i)
                 {
-                    auto& item = tokens_map[elem.doc_id];
-                    item.id = elem.doc_id;
-                    item.weight += elem.weight;
-                    item.words.push_back(elem.word);
+                    if(terms[i].empty() || terms[i].back().query_pos != query_pos)
+                    {
+                        continue;
+                    }
+                    QueryTerm& term = terms[i].back();
+                    term.idf = idf;
+                    term.averages = averages;
+                    term.bound_scale = idf * views[i].GetIndex().Bm25BoundScale(averages);
+                    term.max_score = options.rank == RANK_BM25 ? term.list.MaxBm25() * term.bound_scale
+                                                               : term.list.MaxWeight();
+                }
+                if(query_words.size() == MAX_QUERY_TERMS)
+                {
+                    LOG(WARNING, "查询的词过多，只使用前" + std::to_string(MAX_QUERY_TERMS) + "个");
+                    break;
                 }
-            }
-            for(const auto& item : tokens_map)
-            {
-                inverted_list_all.push_back(std::move(item.second));
             }
 
-            //3.合并排序：汇总查找结果，按照相关性(weight)降序排序
-            // std::sort(inverted_list_all.begin(), inverted_list_all.end(), 
-            //         [](const ns_index::InvertedElem& e1, const ns_index::InvertedElem& e2)
-            //         {return e1.weight > e2.weight;});
+            //3.合并排序：按照相关性(score)降序排序，只选出这一页需要的结果
+            //游标分页只需要count个结果，偏移分页需要前start+count个结果
+            InvertedElemPrint after;
+            after.score = options.after_score;
+            after.id = options.after_id;
+            const InvertedElemPrint* after_ptr = options.use_cursor ? &after : nullptr;
+            size_t k = options.use_cursor ? options.count : options.start + options.count;
+            size_t page_begin = options.use_cursor ? 0 : options.start;
 
-            std::sort(inverted_list_all.begin(), inverted_list_all.end(), 
-                    [](const InvertedElemPrint& e1, const InvertedElemPrint& e2)
-                    {return e1.weight > e2.weight;});
+            //各个段共用一个大小为k的堆，前面的段选出的结果可以帮助后面的段剪枝
+            std::vector<InvertedElemPrint> top_list;
+            uint64_t total = 0;
+            bool exact = true;
+            for(size_t i = 0; i < views.size(); ++i)
+            {
+                //段中只命中一个词时先尝试impact列表，命中总数是精确的
+                if(terms[i].size() == 1 && SearchImpact(views[i], terms[i][0], options.rank, k, after_ptr, &top_list, &total))
+                {
+                    continue;
+                }
+                if(options.exact_total)
+                {
+                    SearchExhaustive(views[i], terms[i], options.rank, k, after_ptr, &top_list, &total);
+                }
+                else
+                {
+                    exact &= SearchWand(views[i], terms[i], options.rank, k, after_ptr, &top_list, &total);
+                }
+            }
+            std::sort_heap(top_list.begin(), top_list.end(), RankBefore);
 
-            //4.构建：根据汇总并排序后的数据，构建json串
+            //4.构建：根据汇总并排序后的数据，只为这一页构建json串
             Json::Value root;
+            Json::Value results(Json::arrayValue);
+            root["total"] = static_cast<Json::UInt64>(total);
+            root["total_relation"] = exact ? "eq" : "gte";//gte表示total只是下界
+            root["start"] = static_cast<Json::UInt64>(options.start);
 
-            if(inverted_list_all.empty())
+            if(total == 0)
             {
                 Json::Value _empty;
                 _empty["title"] = "back to root";
                 _empty["desc"] = "No valid content found!";
                 _empty["url"] = "https://www.boost.org/";
-                root.append(_empty);
+                results.append(_empty);
             }
             
             // Json::Value my_ad;
@@ -105,29 +451,390 @@ namespace ns_searcher
             // my_ad["url"] = "https://blog.csdn.net/weixin_60954394?type=blog";
             // root.append(my_ad);
 
-            for(const InvertedElemPrint& elem : inverted_list_all)
+            for(size_t i = page_begin; i < top_list.size(); ++i)
             {
+                const InvertedElemPrint& elem = top_list[i];
                 //通过每个倒排元素的doc_id获取正排索引
-                ns_index::DocInfo* doc = index->GetForwardIndex(elem.id);
-                if(nullptr == doc)
+                ns_index::DocInfo doc;
+                if(!snapshot->GetForwardIndex(elem.id, &doc))
                 {
                     continue;
                 }
 
                 //构建json串
                 Json::Value item;
-                item["title"] = doc->title;
-                item["desc"] = GetDesc(doc->content, elem.words[0]);//需要显示的是摘要，不是内容
-                item["url"] = doc->url;
+                item["title"] = doc.title.to_string();
+                //摘要使用查询中最靠前的命中词
+                const std::string& word = query_words[__builtin_ctzll(elem.term_mask)];
+                item["desc"] = GetDesc(doc.content, word);//需要显示的是摘要，不是内容
+                item["url"] = doc.url.to_string();
 
-                root.append(item);
+                results.append(item);
             }
 
+            //还有更多结果时返回下一页的游标
+            size_t page_size = top_list.size() - std::min(page_begin, top_list.size());
+            size_t next_start = options.start + page_size;
+            if(page_size > 0 && (next_start < total || (!exact && page_size == options.count)))
+            {
+                root["cursor"] = MakeCursor(next_start, top_list.back());
+            }
+            root["count"] = static_cast<Json::UInt64>(page_size);
+            root["results"] = results;
+
             Json::FastWriter writer;
             *json_string = writer.write(root);
+            cache.Put(cache_key, snapshot->Version(), *json_string);
+        }
+
+        //排序规则：score降序，score相同时doc_id小的在前，保证分页结果稳定
+        static bool RankBefore(const InvertedElemPrint& e1, const InvertedElemPrint& e2)
+        {
+            return e1.score > e2.score || (e1.score == e2.score && e1.id < e2.id);
+        }
+
+        //上界为bound的文档能否进入前k个结果
+        //WAND按doc_id递增的顺序处理文档，score相同的后来者排名靠后，所以必须严格大于堆顶
+        static bool CanEnterTopK(const std::vector<InvertedElemPrint>& top_list, size_t k, double bound)
+        {
+            return top_list.size() < k || (k > 0 && bound > top_list.front().score);
+        }
+
+        //某个词在doc中的得分
+        static double TermScore(const ns_index::Index& index, const QueryTerm& term, RankMode rank,
+                                uint32_t doc_id, uint32_t title_tf, uint32_t content_tf)
+        {
+            if(rank == RANK_BM25)
+            {
+                return index.Bm25(term.idf, term.averages, doc_id, title_tf, content_tf);
+            }
+            return ns_index::TermWeight(title_tf, content_tf);
+        }
+
+        //以RankBefore为比较规则、大小为k的堆，堆顶是当前k个结果中排名最靠后的
+        static void PushTopK(std::vector<InvertedElemPrint>* top_list, size_t k, InvertedElemPrint&& item)
+        {
+            if(top_list->size() < k)
+            {
+                top_list->push_back(std::move(item));
+                std::push_heap(top_list->begin(), top_list->end(), RankBefore);
+            }
+            else if(k > 0 && RankBefore(item, top_list->front()))
+            {
+                std::pop_heap(top_list->begin(), top_list->end(), RankBefore);
+                top_list->back() = std::move(item);
+                std::push_heap(top_list->begin(), top_list->end(), RankBefore);
+            }
+        }
+
+        //段中只命中一个词：高频词的impact列表按分数降序排列，从头读到不可能再进入前k个结果为止
+        //没有impact列表、或者读完impact列表仍不能确定结果时返回false，top_list和total保持不变；已删除的文档跳过
+        static bool SearchImpact(const ns_index::SegmentView& view, const QueryTerm& term, RankMode rank, size_t k,
+                                 const InvertedElemPrint* after, std::vector<InvertedElemPrint>* top_list, uint64_t* total)
+        {
+            const ns_index::Index& index = view.GetIndex();
+            std::shared_ptr<const ns_index::ImpactList> impacts =
+                index.GetImpactList(term.term_id, rank == RANK_BM25 ? ns_index::IMPACT_BM25 : ns_index::IMPACT_WEIGHT);
+            if(impacts == nullptr)
+            {
+                return false;
+            }
+            //BM25的impact列表是按段内平均长度计算的饱和值排序的，换成整个快照的平均长度之后顺序可能变化，
+            //所以用每个元素换算之后的上界判断能否停止；上界是浮点数乘积，与WAND一样放宽一点
+            const double slack = rank == RANK_BM25 ? 1 + 1e-9 : 1;
+            const uint64_t term_bit = static_cast<uint64_t>(1) << term.query_pos;
+            //只有一部分倒排元素时，不能确定结果要恢复原状
+            const bool complete = impacts->size() == term.list.size();
+            std::vector<InvertedElemPrint> saved;
+            if(!complete)
+            {
+                saved = *top_list;
+            }
+
+            bool finished = complete;
+            double last_bound = 0;
+            for(const ns_index::ImpactEntry& entry : *impacts)
+            {
+                InvertedElemPrint item;
+                item.id = view.base + entry.doc_id;
+                item.score = TermScore(index, term, rank, entry.doc_id, entry.title_tf, entry.content_tf);
+                item.term_mask = term_bit;
+                //这个元素及之后的元素(包括不在impact列表中的)分数都不超过last_bound
+                last_bound = rank == RANK_BM25 ? index.LocalBm25Tf(entry.doc_id, entry.title_tf, entry.content_tf) * term.bound_scale
+                                               : item.score;
+                //分数相同的doc_id小的也可能进入，所以严格小于堆顶时才停止
+                if(top_list->size() >= k && (k == 0 || last_bound * slack < top_list->front().score))
+                {
+                    finished = true;
+                    break;
+                }
+                if(view.IsDeleted(entry.doc_id) || (after != nullptr && !RankBefore(*after, item)))
+                {
+                    continue;
+                }
+                PushTopK(top_list, k, std::move(item));
+            }
+            //不在impact列表中的文档分数都不超过列表中最后一个元素的上界
+            if(!finished && top_list->size() >= k && (k == 0 || last_bound * slack < top_list->front().score))
+            {
+                finished = true;
+            }
+            if(!finished)
+            {
+                top_list->swap(saved);
+                return false;
+            }
+            *total += term.live_doc_freq;
+            return true;
+        }
+
+        //在一个段中逐个词累加全部倒排拉链(TAAT)，命中的文档放入大小为k的堆top_list，命中总数累加到total，是精确的
+        //after不为空时只考虑排在after之后的结果；top_list由调用者在所有段处理完之后排序
+        static void SearchExhaustive(const ns_index::SegmentView& view, const std::vector<QueryTerm>& terms, RankMode rank,
+                                     size_t k, const InvertedElemPrint* after,
+                                     std::vector<InvertedElemPrint>* top_list, uint64_t* total)
+        {
+            const ns_index::Index& index = view.GetIndex();
+            static thread_local ScoreAccumulator acc;
+            acc.Reset(index.DocCount());
+            double* scores = acc.scores.data();
+            uint64_t* term_masks = acc.term_masks.data();
+
+            for(size_t i = 0; i < terms.size(); ++i)
+            {
+                //将倒排拉链中的倒排元素按块累加到doc_id对应的位置，doc_id相同的自然合并
+                const uint64_t term_bit = static_cast<uint64_t>(1) << terms[i].query_pos;
+                for(ns_index::PostingIterator iter(terms[i].list); !iter.End(); iter.NextBlock())
+                {
+                    const uint32_t* doc_ids = iter.BlockDocIds();
+                    const uint32_t* title_tfs = iter.BlockTitleTfs();
+                    const uint32_t* content_tfs = iter.BlockContentTfs();
+                    for(uint32_t j = 0; j < iter.BlockLength(); ++j)
+                    {
+                        uint32_t doc_id = doc_ids[j];
+                        if(term_masks[doc_id] == 0)
+                        {
+                            acc.touched.push_back(doc_id);
+                        }
+                        scores[doc_id] += TermScore(index, terms[i], rank, doc_id, title_tfs[j], content_tfs[j]);
+                        term_masks[doc_id] |= term_bit;
+                    }
+                }
+            }
+
+            for(uint32_t doc_id : acc.touched)
+            {
+                if(view.IsDeleted(doc_id))
+                {
+                    continue;
+                }
+                ++*total;
+                InvertedElemPrint item;
+                item.id = view.base + doc_id;
+                item.score = scores[doc_id];
+                item.term_mask = term_masks[doc_id];
+                if(after != nullptr && !RankBefore(*after, item))
+                {
+                    continue;
+                }
+                PushTopK(top_list, k, std::move(item));
+            }
+        }
+
+        //Block-Max WAND：在一个段中按doc_id递增的顺序逐个文档求值(DAAT)，用每个词以及每个块的最大分数估计上界，
+        //上界进入不了前k个结果的文档直接跳过，不解码也不打分
+        //结果与SearchExhaustive一样放入top_list，命中总数累加到total，返回total是否精确：发生跳过时只是下界
+        static bool SearchWand(const ns_index::SegmentView& view, const std::vector<QueryTerm>& terms, RankMode rank,
+                               size_t k, const InvertedElemPrint* after,
+                               std::vector<InvertedElemPrint>* top_list, uint64_t* total)
+        {
+            const ns_index::Index& index = view.GetIndex();
+            //BM25的上界是按另一种顺序累加的浮点数，放宽一点避免舍入误差剪掉本该进入的文档
+            const double slack = rank == RANK_BM25 ? 1 + 1e-9 : 1;
+            struct TermCursor
+            {
+                ns_index::PostingIterator iter;
+                const QueryTerm* term;
+
+                explicit TermCursor(const QueryTerm& query_term)
+                    :iter(query_term.list), term(&query_term)
+                {}
+            };
+
+            std::vector<TermCursor> cursors;
+            cursors.reserve(terms.size());//保证游标的地址不变
+            std::vector<TermCursor*> active;
+            uint64_t max_live_doc_freq = 0;
+            for(size_t i = 0; i < terms.size(); ++i)
+            {
+                cursors.emplace_back(terms[i]);
+                if(!cursors.back().iter.End())
+                {
+                    active.push_back(&cursors.back());
+                }
+                max_live_doc_freq = std::max(max_live_doc_freq, terms[i].live_doc_freq);
+            }
+
+            auto by_doc = [](const TermCursor* c1, const TermCursor* c2){return c1->iter.DocId() < c2->iter.DocId();};
+            auto ended = [](const TermCursor* c){return c->iter.End();};
+            auto by_query_pos = [](const TermCursor* c1, const TermCursor* c2){return c1->term->query_pos < c2->term->query_pos;};
+
+            uint64_t scored = 0;
+            bool pruned = false;
+            while(!active.empty())
+            {
+                std::sort(active.begin(), active.end(), by_doc);
+
+                //1.找pivot：按doc_id顺序累加各个词的最大分数，第一个可能进入前k个结果的位置
+                double bound = 0;
+                size_t pivot = active.size();
+                for(size_t i = 0; i < active.size(); ++i)
+                {
+                    bound += active[i]->term->max_score;
+                    if(CanEnterTopK(*top_list, k, bound * slack))
+                    {
+                        pivot = i;
+                        break;
+                    }
+                }
+                if(pivot == active.size())
+                {
+                    //剩下的文档都不可能进入前k个结果
+                    pruned = true;
+                    break;
+                }
+                uint32_t pivot_doc = active[pivot]->iter.DocId();
+                while(pivot + 1 < active.size() && active[pivot + 1]->iter.DocId() == pivot_doc)
+                {
+                    ++pivot;
+                }
+
+                //2.用pivot_doc所在块的最大分数再次估计上界，同时算出这些块之后第一个可能命中的doc_id
+                double block_bound = 0;
+                uint64_t next_doc = pivot + 1 < active.size() ? active[pivot + 1]->iter.DocId() : UINT32_MAX;
+                for(size_t i = 0; i <= pivot; ++i)
+                {
+                    const ns_index::PostingIterator& iter = active[i]->iter;
+                    uint32_t b = iter.FindBlock(pivot_doc);
+                    if(b == iter.List().BlockCount())
+                    {
+                        continue;//拉链在pivot_doc之前就结束了
+                    }
+                    const ns_index::BlockRecord& block = iter.List().Blocks()[b];
+                    block_bound += rank == RANK_BM25 ? block.max_bm25 * active[i]->term->bound_scale : block.max_weight;
+                    next_doc = std::min<uint64_t>(next_doc, static_cast<uint64_t>(block.last_doc_id) + 1);
+                }
+
+                if(!CanEnterTopK(*top_list, k, block_bound * slack))
+                {
+                    //[pivot_doc, next_doc)之间的文档都不可能进入前k个结果，整体跳过
+                    pruned = true;
+                    for(size_t i = 0; i <= pivot; ++i)
+                    {
+                        active[i]->iter.Advance(static_cast<uint32_t>(next_doc));
+                    }
+                }
+                else if(active[0]->iter.DocId() == pivot_doc)
+                {
+                    //3.pivot之前的游标都已经对齐到pivot_doc，完整打分，已删除的文档不打分
+                    //按词在查询中的顺序累加，与逐个词累加的结果完全一致
+                    if(!view.IsDeleted(pivot_doc))
+                    {
+                        ++scored;
+                        std::sort(active.begin(), active.begin() + pivot + 1, by_query_pos);
+                        InvertedElemPrint item;
+                        item.id = view.base + pivot_doc;
+                        for(size_t i = 0; i <= pivot; ++i)
+                        {
+                            const ns_index::PostingIterator& iter = active[i]->iter;
+                            item.score += TermScore(index, *active[i]->term, rank, pivot_doc, iter.TitleTf(), iter.ContentTf());
+                        }
+                        if((after == nullptr || RankBefore(*after, item)) && CanEnterTopK(*top_list, k, item.score))
+                        {
+                            for(size_t i = 0; i <= pivot; ++i)
+                            {
+                                item.term_mask |= static_cast<uint64_t>(1) << active[i]->term->query_pos;
+                            }
+                            PushTopK(top_list, k, std::move(item));
+                        }
+                    }
+                    for(size_t i = 0; i <= pivot; ++i)
+                    {
+                        active[i]->iter.Next();
+                    }
+                }
+                else
+                {
+                    //pivot_doc之前的文档不可能进入前k个结果，把落后的游标直接移动到pivot_doc
+                    pruned = true;
+                    for(size_t i = 0; active[i]->iter.DocId() < pivot_doc; ++i)
+                    {
+                        active[i]->iter.Advance(pivot_doc);
+                    }
+                }
+                active.erase(std::remove_if(active.begin(), active.end(), ended), active.end());
+            }
+
+            //只有一个词时，命中总数就是它未删除的文档数
+            if(terms.size() == 1)
+            {
+                *total += terms[0].live_doc_freq;
+                return true;
+            }
+            //每个词未删除的文档一定都命中
+            *total += pruned ? std::max(scored, max_live_doc_freq) : scored;
+            return !pruned;
+        }
+
+    private:
+        //以下两个函数需要持有reload_mtx
+        //check_source为true时索引文件不是由当前的raw.txt建立的(比如重新执行了parser而没有执行indexer)也视为加载失败
+        bool LoadSnapshot(bool check_source = false)
+        {
+            ns_util::FileUtil::FileStamp stamp;
+            std::shared_ptr<ns_index::Index> fresh = std::make_shared<ns_index::Index>();
+            if(!ns_util::FileUtil::GetFileStamp(index_file, &stamp) || !fresh->LoadIndex(index_file))
+            {
+                return false;
+            }
+            if(check_source && !fresh->MatchesSource(input))
+            {
+                LOG(WARNING, "索引文件 " + index_file + " 与 " + input + " 不一致，已经过期");
+                return false;
+            }
+            fresh->PinHotTerms(pinned_terms);
+            Publish(fresh);
+            loaded_stamp = stamp;
+            return true;
+        }
+
+        bool BuildSnapshot(size_t thread_num)
+        {
+            std::shared_ptr<ns_index::Index> fresh = std::make_shared<ns_index::Index>();
+            if(!fresh->BuildIndex(input, thread_num))
+            {
+                LOG(WARNING, "建立索引失败，继续使用当前的索引");
+                return false;
+            }
+            fresh->PinHotTerms(pinned_terms);
+            Publish(fresh);
+            //同时更新索引文件，下次启动可以直接加载
+            if(fresh->SaveIndex(index_file))
+            {
+                ns_util::FileUtil::GetFileStamp(index_file, &loaded_stamp);
+            }
+            return true;
+        }
+
+        //用新索引整体替换全部的段，查询线程看到的要么是完整的旧快照，要么是完整的新快照
+        //增量添加、删除的文档没有写回raw.txt，不在新索引中，丢弃的修改数记录在日志中
+        void Publish(const std::shared_ptr<ns_index::Index>& fresh)
+        {
+            segments.Reset(fresh);
+            LOG(NORMAL, "发布索引快照，文档数: " + std::to_string(fresh->DocCount()));
         }
 
-        std::string GetDesc(const std::string& content, const std::string& word)
+        static std::string GetDesc(boost::string_view content, boost::string_view word)
         {
             //找到word在content中首次出现的位置，分别向前与向后截取一定长度作为desc
             //1.word首次出现
@@ -156,7 +863,7 @@ namespace ns_searcher
                 return "None2";
 
             //3.截取子串
-            std::string desc = content.substr(start, end-start);
+            std::string desc = content.substr(start, end-start).to_string();
             desc += "...";
             return desc;
         }
@@ -0,0 +1,577 @@
+#pragma once
+
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <unordered_map>
+#include <set>
+#include <chrono>
+#include "index.hpp"
+#include "log.hpp"
+#include "cppjieba/limonp/ThreadPool.hpp"
+
+namespace ns_index
+{
+    //一个段：不可变的索引镜像，以及url到doc_id的映射，用于更新和删除文档
+    struct Segment
+    {
+        std::shared_ptr<const Index> index;
+        std::unordered_multimap<std::string, uint32_t> url_ids;
+
+        explicit Segment(const std::shared_ptr<const Index>& segment_index)
+            :index(segment_index)
+        {
+            DocInfo doc;
+            for(uint64_t i = 0; i < index->DocCount(); ++i)
+            {
+                index->GetForwardIndex(i, &doc);
+                url_ids.emplace(doc.url.to_string(), static_cast<uint32_t>(i));
+            }
+        }
+    };
+
+    //删除标记：第i位为1表示段内doc_id为i的文档已经删除
+    typedef std::vector<uint64_t> Tombstones;
+
+    //快照中的一个段及其删除标记
+    struct SegmentView
+    {
+        std::shared_ptr<const Segment> segment;
+        std::shared_ptr<const Tombstones> deleted;//没有删除时为空
+        uint64_t deleted_count;
+        uint64_t deleted_title_tokens;//已删除文档的分词个数之和，统计平均长度时扣除
+        uint64_t deleted_content_tokens;
+        uint64_t base;//段内第一个文档在整个快照中的doc_id
+
+        SegmentView()
+            :deleted_count(0), deleted_title_tokens(0), deleted_content_tokens(0), base(0)
+        {}
+
+        const Index& GetIndex() const { return *segment->index; }
+        uint64_t DocCount() const { return segment->index->DocCount(); }
+
+        bool IsDeleted(uint32_t doc_id) const
+        {
+            return deleted != nullptr && ((*deleted)[doc_id / 64] >> (doc_id % 64) & 1);
+        }
+
+        //倒排拉链中未删除的文档数：按doc_id递增的顺序在拉链中查找每个已删除的文档，借助跳表最多解码min(删除数, 块数)个块
+        uint64_t LiveDocFreq(const InvertedList& list) const
+        {
+            if(deleted_count == 0 || list.empty())
+            {
+                return list.size();
+            }
+            uint64_t dead = 0;
+            PostingIterator iter(list);
+            for(size_t w = 0; w < deleted->size() && !iter.End(); ++w)
+            {
+                for(uint64_t bits = (*deleted)[w]; bits != 0 && !iter.End(); bits &= bits - 1)
+                {
+                    const uint32_t doc_id = static_cast<uint32_t>(w * 64 + __builtin_ctzll(bits));
+                    iter.Advance(doc_id);
+                    if(!iter.End() && iter.DocId() == doc_id)
+                    {
+                        ++dead;
+                    }
+                }
+            }
+            return list.size() - dead;
+        }
+    };
+
+    //一份完整的索引快照：按顺序排列的若干个段，发布之后只读
+    //各个段的doc_id依次拼接成整个快照的doc_id，越新的段doc_id越大
+    class IndexSnapshot
+    {
+    private:
+        std::vector<SegmentView> segments;
+        uint64_t doc_count;//包括已经删除的文档
+        uint64_t live_count;
+        Bm25Averages averages;//未删除文档的各字段平均长度
+        uint64_t version;//发布的序号，内容有任何变化都会递增
+    public:
+        IndexSnapshot(std::vector<SegmentView> views, uint64_t version_)
+            :segments(std::move(views)), doc_count(0), live_count(0), version(version_)
+        {
+            uint64_t title_tokens = 0;
+            uint64_t content_tokens = 0;
+            for(SegmentView& view : segments)
+            {
+                view.base = doc_count;
+                doc_count += view.DocCount();
+                live_count += view.DocCount() - view.deleted_count;
+                title_tokens += view.GetIndex().TitleTokens() - view.deleted_title_tokens;
+                content_tokens += view.GetIndex().ContentTokens() - view.deleted_content_tokens;
+            }
+            if(live_count > 0)
+            {
+                averages.title = static_cast<double>(title_tokens) / live_count;
+                averages.content = static_cast<double>(content_tokens) / live_count;
+            }
+        }
+
+        const std::vector<SegmentView>& Segments() const { return segments; }
+        uint64_t DocCount() const { return doc_count; }
+        uint64_t LiveCount() const { return live_count; }
+        const Bm25Averages& Averages() const { return averages; }
+        uint64_t Version() const { return version; }
+
+        //根据整个快照中的doc_id找到文档内容
+        bool GetForwardIndex(uint64_t doc_id, DocInfo* doc) const
+        {
+            auto iter = std::upper_bound(segments.begin(), segments.end(), doc_id,
+                    [](uint64_t id, const SegmentView& view){return id < view.base;});
+            if(iter == segments.begin())
+            {
+                return false;
+            }
+            --iter;
+            if(!iter->GetIndex().GetForwardIndex(doc_id - iter->base, doc))
+            {
+                return false;
+            }
+            doc->doc_id = doc_id;
+            return true;
+        }
+    };
+
+    //后台合并的统计信息
+    struct MergeStats
+    {
+        uint64_t merges;//完成的合并次数
+        uint64_t forced_merges;//其中为了限制段数而不按层级进行的合并
+        uint64_t aborted_merges;//合并期间段被替换而放弃的合并
+        uint64_t segments_merged;//被合并掉的段数
+        uint64_t docs_merged;//合并后写出的文档数
+        uint64_t deleted_docs_purged;//合并时清理掉的已删除文档
+        uint64_t bytes_written;//合并后写出的索引镜像字节数
+        uint64_t merge_millis;//合并花费的时间，包括限速等待
+        uint64_t running;//正在进行的合并
+        uint64_t flush_stalls;//段数过多而推迟的刷盘次数
+
+        MergeStats()
+            :merges(0), forced_merges(0), aborted_merges(0), segments_merged(0), docs_merged(0),
+             deleted_docs_purged(0), bytes_written(0), merge_millis(0), running(0), flush_stalls(0)
+        {}
+    };
+
+    //段的写入端，LSM的方式增量更新索引：
+    //新文档先进入内存中的memtable，定期刷成一个新的小段；删除只在快照中打删除标记；
+    //段在后台线程池中按层级合并，合并限速，不与查询争抢CPU
+    //每次修改都生成一份新的快照整体发布，查询线程只读取快照，不会被写入阻塞
+    class SegmentManager
+    {
+    public:
+        //memtable中的文档数达到这个值时立即刷成段
+        static const size_t MEMTABLE_MAX_DOCS = 1000;
+        //分层合并：未删除文档数在[MIN_SEGMENT_DOCS * MERGE_FACTOR^(t-1), MIN_SEGMENT_DOCS * MERGE_FACTOR^t)的段属于第t层，
+        //同一层相邻的段达到MERGE_FACTOR个时合并成上一层的一个段，每次最多合并MAX_MERGE_SEGMENTS个
+        static const uint64_t MIN_SEGMENT_DOCS = 64;
+        static const size_t MERGE_FACTOR = 4;
+        static const size_t MAX_MERGE_SEGMENTS = 10;
+        //删除的文档超过段内文档数的1/DELETED_RATIO时单独合并这个段，回收空间
+        static const uint64_t DELETED_RATIO = 3;
+        //一次查询最多扇出到的段数：超过时不按层级合并最新的段；达到两倍时推迟刷盘，新文档留在memtable中
+        static const size_t MAX_SEGMENTS = 16;
+        //合并线程数和合并速度(每秒读入的索引镜像字节数)
+        static const size_t MERGE_THREADS = 2;
+        static const uint64_t MERGE_BYTES_PER_SEC = 64 << 20;
+    private:
+        //一次合并：快照中相邻的若干个段
+        struct MergeTask
+        {
+            std::vector<SegmentView> run;
+            bool forced;
+        };
+
+        std::shared_ptr<const IndexSnapshot> current;
+        std::mutex write_mtx;//修改快照、memtable和统计信息的线程互斥
+        IndexBuilder memtable;//还没有刷成段的新文档
+        std::set<const Segment*> merging;//正在合并的段
+        MergeStats stats;
+        //上一次Reset之后添加(包括更新)的文档数和删除的url数，这些修改不在raw.txt中，下一次Reset时会丢失
+        uint64_t unsaved_adds;
+        uint64_t unsaved_deletes;
+        uint64_t version;//最近一次发布的快照序号
+        bool stopping;//析构时不再提交新的合并
+        ns_util::RateLimiter merge_limiter;
+        limonp::ThreadPool merge_pool;//最后一个成员，析构时最先等待合并线程退出
+    public:
+        SegmentManager()
+            :current(std::make_shared<IndexSnapshot>(std::vector<SegmentView>(), 0)),
+             unsaved_adds(0), unsaved_deletes(0), version(0), stopping(false), merge_limiter(MERGE_BYTES_PER_SEC), merge_pool(MERGE_THREADS)
+        {
+            merge_pool.Start();
+        }
+        ~SegmentManager()
+        {
+            {
+                std::lock_guard<std::mutex> lock(write_mtx);
+                stopping = true;
+            }
+            //等待正在进行的合并结束
+            merge_pool.Stop();
+        }
+        SegmentManager(const SegmentManager&) = delete;
+        SegmentManager& operator=(const SegmentManager&) = delete;
+
+        std::shared_ptr<const IndexSnapshot> Snapshot() const
+        {
+            return std::atomic_load(&current);
+        }
+
+        MergeStats GetMergeStats()
+        {
+            std::lock_guard<std::mutex> lock(write_mtx);
+            return stats;
+        }
+
+        //用一个完整的索引替换全部的段，还没有刷成段的新文档一并丢弃
+        //index由raw.txt或者索引文件得到，不包含上一次Reset之后的增量修改，丢弃时记录日志
+        void Reset(const std::shared_ptr<const Index>& index)
+        {
+            std::lock_guard<std::mutex> lock(write_mtx);
+            if(unsaved_adds > 0 || unsaved_deletes > 0)
+            {
+                LOG(WARNING, "替换全部的段，丢弃增量修改: 添加或更新的文档 " + std::to_string(unsaved_adds) +
+                             ", 删除的url " + std::to_string(unsaved_deletes));
+            }
+            unsaved_adds = 0;
+            unsaved_deletes = 0;
+            memtable = IndexBuilder();
+            std::vector<SegmentView> views(1);
+            views[0].segment = std::make_shared<Segment>(index);
+            Publish(std::move(views));
+        }
+
+        //line的格式与raw.txt相同：title\3content\3url
+        //url已经存在时作为更新，新文档可见的同时旧文档被删除
+        bool AddDocument(const std::string& line)
+        {
+            //分词在锁外进行，多个线程可以同时添加
+            IndexBuilder doc;
+            if(!doc.AddDocument(line))
+            {
+                return false;
+            }
+            bool full = false;
+            {
+                std::lock_guard<std::mutex> lock(write_mtx);
+                if(!memtable.Merge(std::move(doc)))
+                {
+                    return false;
+                }
+                ++unsaved_adds;
+                full = memtable.DocCount() >= MEMTABLE_MAX_DOCS;
+            }
+            if(full)
+            {
+                Flush();
+            }
+            return true;
+        }
+
+        //删除url对应的全部文档，返回是否找到
+        bool DeleteDocument(const std::string& url)
+        {
+            std::lock_guard<std::mutex> lock(write_mtx);
+            //memtable中也可能有这个url，先刷成段，这里不推迟
+            FlushLocked();
+            std::vector<SegmentView> views = current->Segments();
+            std::vector<std::shared_ptr<Tombstones> > copies(views.size());
+            bool found = false;
+            for(size_t i = 0; i < views.size(); ++i)
+            {
+                auto range = views[i].segment->url_ids.equal_range(url);
+                for(auto iter = range.first; iter != range.second; ++iter)
+                {
+                    found |= MarkDeleted(&views, &copies, i, iter->second);
+                }
+            }
+            if(found)
+            {
+                ++unsaved_deletes;
+                Publish(std::move(views));
+            }
+            ScheduleMerges();
+            return found;
+        }
+
+        //把memtable刷成一个新段并发布，返回是否发布了新快照
+        //段数过多时推迟，等合并追上之后再刷
+        bool Flush()
+        {
+            std::lock_guard<std::mutex> lock(write_mtx);
+            if(memtable.DocCount() > 0 && current->Segments().size() >= 2 * MAX_SEGMENTS)
+            {
+                ++stats.flush_stalls;
+                return false;
+            }
+            bool flushed = FlushLocked();
+            ScheduleMerges();
+            return flushed;
+        }
+    private:
+        //段所在的层
+        static size_t Tier(const SegmentView& view)
+        {
+            size_t tier = 0;
+            for(uint64_t live = view.DocCount() - view.deleted_count; live >= MIN_SEGMENT_DOCS; live /= MERGE_FACTOR)
+            {
+                ++tier;
+            }
+            return tier;
+        }
+
+        //按合并策略挑出需要合并的段交给线程池，需要持有write_mtx
+        //线程池中排队和正在进行的合并不超过线程数，提交任务不会阻塞
+        void ScheduleMerges()
+        {
+            if(stopping)
+            {
+                return;
+            }
+            const std::vector<SegmentView>& views = current->Segments();
+            //合并全部完成之后的段数
+            size_t fan_out = views.size();
+            std::vector<MergeTask*> tasks;
+            auto submit = [&](size_t begin, size_t end, bool forced)
+            {
+                MergeTask* task = new MergeTask();
+                task->run.assign(views.begin() + begin, views.begin() + end);
+                task->forced = forced;
+                for(const SegmentView& view : task->run)
+                {
+                    merging.insert(view.segment.get());
+                }
+                fan_out -= task->run.size() - 1;
+                ++stats.running;
+                tasks.push_back(task);
+            };
+            auto idle = [this](const SegmentView& view){return merging.count(view.segment.get()) == 0;};
+
+            //1.从最新的段开始，找同一层相邻的段
+            size_t end = views.size();
+            while(end > 0 && stats.running < MERGE_THREADS)
+            {
+                size_t begin = end - 1;
+                if(!idle(views[begin]))
+                {
+                    end = begin;
+                    continue;
+                }
+                const size_t tier = Tier(views[begin]);
+                while(begin > 0 && end - begin < MAX_MERGE_SEGMENTS && idle(views[begin - 1]) && Tier(views[begin - 1]) == tier)
+                {
+                    --begin;
+                }
+                if(end - begin >= MERGE_FACTOR)
+                {
+                    submit(begin, end, false);
+                }
+                end = begin;
+            }
+            //2.删除的文档过多的段单独合并
+            for(size_t i = 0; i < views.size() && stats.running < MERGE_THREADS; ++i)
+            {
+                if(idle(views[i]) && views[i].deleted_count > 0 && views[i].deleted_count * DELETED_RATIO >= views[i].DocCount())
+                {
+                    submit(i, i + 1, false);
+                }
+            }
+            //3.段数仍然过多时，不按层级合并最新的几个相邻的段
+            end = views.size();
+            while(fan_out > MAX_SEGMENTS && end > 1 && stats.running < MERGE_THREADS)
+            {
+                size_t begin = end;
+                while(begin > 0 && end - begin < MAX_MERGE_SEGMENTS && idle(views[begin - 1]))
+                {
+                    --begin;
+                }
+                if(end - begin >= 2)
+                {
+                    submit(begin, end, true);
+                    ++stats.forced_merges;
+                }
+                end = begin == end ? end - 1 : begin;
+            }
+
+            for(MergeTask* task : tasks)
+            {
+                merge_pool.Add(limonp::NewClosure(this, &SegmentManager::RunMerge, task));
+            }
+        }
+
+        //在线程池中执行一次合并
+        void RunMerge(MergeTask* task)
+        {
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            uint64_t bytes = 0;
+            bool merged = MergeSegments(task->run, &bytes);
+            uint64_t millis = std::chrono::duration_cast<std::chrono::milliseconds>(
+                                  std::chrono::steady_clock::now() - start).count();
+
+            std::lock_guard<std::mutex> lock(write_mtx);
+            for(const SegmentView& view : task->run)
+            {
+                merging.erase(view.segment.get());
+            }
+            --stats.running;
+            stats.merge_millis += millis;
+            if(merged)
+            {
+                ++stats.merges;
+                stats.segments_merged += task->run.size();
+                stats.bytes_written += bytes;
+            }
+            else
+            {
+                ++stats.aborted_merges;
+            }
+            delete task;
+            //合并出来的段可能又凑够了一层
+            ScheduleMerges();
+        }
+
+        //把快照中相邻的若干个段合并成一个段：直接复制未删除文档的倒排，不需要重新分词
+        bool MergeSegments(const std::vector<SegmentView>& run, uint64_t* bytes)
+        {
+            IndexBuilder builder;
+            std::vector<std::vector<uint32_t> > remaps(run.size());
+            for(size_t i = 0; i < run.size(); ++i)
+            {
+                merge_limiter.Acquire(run[i].GetIndex().ImageSize());
+                if(!builder.AppendIndex(run[i].GetIndex(), run[i].deleted.get(), &remaps[i]))
+                {
+                    LOG(WARNING, "合并段失败，文档数过多");
+                    return false;
+                }
+            }
+            std::shared_ptr<Index> index = std::make_shared<Index>();
+            index->BuildIndex(builder);
+            std::vector<SegmentView> merged(1);
+            merged[0].segment = std::make_shared<Segment>(index);
+            *bytes = index->ImageSize();
+
+            std::lock_guard<std::mutex> lock(write_mtx);
+            //合并期间这些段可能已经被Reset替换，此时放弃这次合并
+            std::vector<SegmentView> views = current->Segments();
+            size_t pos = 0;
+            while(pos < views.size() && views[pos].segment != run[0].segment)
+            {
+                ++pos;
+            }
+            if(pos + run.size() > views.size())
+            {
+                return false;
+            }
+            uint64_t purged = 0;
+            for(size_t i = 0; i < run.size(); ++i)
+            {
+                if(views[pos + i].segment != run[i].segment)
+                {
+                    return false;
+                }
+                purged += run[i].deleted_count;
+            }
+
+            //合并期间新增的删除标记转移到新段上
+            std::vector<std::shared_ptr<Tombstones> > copies(1);
+            for(size_t i = 0; i < run.size(); ++i)
+            {
+                const SegmentView& now = views[pos + i];
+                if(now.deleted_count == run[i].deleted_count)
+                {
+                    continue;
+                }
+                for(uint32_t doc_id = 0; doc_id < now.DocCount(); ++doc_id)
+                {
+                    if(now.IsDeleted(doc_id) && remaps[i][doc_id] != UINT32_MAX)
+                    {
+                        MarkDeleted(&merged, &copies, 0, remaps[i][doc_id]);
+                    }
+                }
+            }
+            views.erase(views.begin() + pos, views.begin() + pos + run.size());
+            views.insert(views.begin() + pos, merged[0]);
+            Publish(std::move(views));
+            stats.docs_merged += index->DocCount();
+            stats.deleted_docs_purged += purged;
+            return true;
+        }
+
+        //需要持有write_mtx
+        bool FlushLocked()
+        {
+            if(memtable.DocCount() == 0)
+            {
+                return false;
+            }
+            std::shared_ptr<Index> index = std::make_shared<Index>();
+            index->BuildIndex(memtable);
+            memtable = IndexBuilder();
+
+            std::vector<SegmentView> views = current->Segments();
+            views.push_back(SegmentView());
+            views.back().segment = std::make_shared<Segment>(index);
+
+            //同一个url以最新的文档为准：删除旧段中的文档，以及新段中排在前面的文档
+            std::vector<std::shared_ptr<Tombstones> > copies(views.size());
+            const size_t last = views.size() - 1;
+            DocInfo doc;
+            for(uint64_t doc_id = 0; doc_id < index->DocCount(); ++doc_id)
+            {
+                index->GetForwardIndex(doc_id, &doc);
+                const std::string url = doc.url.to_string();
+                for(size_t i = 0; i < views.size(); ++i)
+                {
+                    auto range = views[i].segment->url_ids.equal_range(url);
+                    for(auto iter = range.first; iter != range.second; ++iter)
+                    {
+                        if(i != last || iter->second < doc_id)
+                        {
+                            MarkDeleted(&views, &copies, i, iter->second);
+                        }
+                    }
+                }
+            }
+            Publish(std::move(views));
+            return true;
+        }
+
+        //删除(*views)[i]中的doc_id，删除标记写时复制，同一次修改中每个段只复制一次
+        static bool MarkDeleted(std::vector<SegmentView>* views, std::vector<std::shared_ptr<Tombstones> >* copies,
+                                size_t i, uint32_t doc_id)
+        {
+            SegmentView& view = (*views)[i];
+            if(view.IsDeleted(doc_id))
+            {
+                return false;
+            }
+            std::shared_ptr<Tombstones>& bits = (*copies)[i];
+            if(bits == nullptr)
+            {
+                bits = view.deleted != nullptr ? std::make_shared<Tombstones>(*view.deleted)
+                                               : std::make_shared<Tombstones>((view.DocCount() + 63) / 64, 0);
+                view.deleted = bits;
+            }
+            (*bits)[doc_id / 64] |= static_cast<uint64_t>(1) << (doc_id % 64);
+            ++view.deleted_count;
+            uint32_t title_length = 0;
+            uint32_t content_length = 0;
+            view.GetIndex().GetDocLengths(doc_id, &title_length, &content_length);
+            view.deleted_title_tokens += title_length;
+            view.deleted_content_tokens += content_length;
+            return true;
+        }
+
+        //需要持有write_mtx
+        void Publish(std::vector<SegmentView> views)
+        {
+            std::shared_ptr<const IndexSnapshot> snapshot = std::make_shared<IndexSnapshot>(std::move(views), ++version);
+            std::atomic_store(&current, snapshot);
+        }
+    };
+}
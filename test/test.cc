@@ -1,10 +1,11 @@
 #include "searcher.hpp"
 
 const std::string input = "data/raw_html/raw.txt";
+const std::string index_file = "data/raw_html/index.bin";
 int main()
 {
     ns_searcher::Searcher* searcher = new ns_searcher::Searcher();
-    searcher->InitSearcher(input);
+    searcher->InitSearcher(index_file, input);
     std::string query;
     std::string json_string;
     while(true)
@@ -3,9 +3,20 @@
 #include <string>
 #include <vector>
 #include <unordered_set>
+#include <unordered_map>
+#include <list>
 #include <fstream>
 #include <mutex>
+#include <thread>
+#include <chrono>
+#include <cerrno>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <boost/algorithm/string.hpp>
+#include <boost/utility/string_view.hpp>
 #include "cppjieba/Jieba.hpp"
 #include "log.hpp"
 
@@ -14,22 +25,186 @@ namespace ns_util
     class FileUtil
     {
     public:
+        //一次读入整个文件：fstat得到大小之后预先分配好out，再用read读入，内容原样保留(包括换行)
+        //out原有的内容被覆盖，容量保留，反复用同一个out读多个文件时不需要重新分配内存
         static bool ReadFile(const std::string &file_path, std::string *out)
         {
-            std::ifstream in(file_path);
-            if (!in.is_open())
+            out->clear();
+            int fd = open(file_path.c_str(), O_RDONLY);
+            if (fd < 0)
             {
                 std::cerr << "open file" << file_path << "failed!" << std::endl;
                 return false;
             }
-            std::string line;
-            while (std::getline(in, line))
+            struct stat st;
+            if (fstat(fd, &st) < 0)
             {
-                *out += line;
+                std::cerr << "stat file " << file_path << " failed!" << std::endl;
+                close(fd);
+                return false;
             }
-            in.close();
+            //多留一个字节，正好读到文件末尾时不需要扩容就能读到EOF
+            out->resize(static_cast<size_t>(st.st_size) + 1);
+            size_t done = 0;
+            while (true)
+            {
+                if (done == out->size())
+                {
+                    //文件在fstat之后变大了，或者大小未知(比如管道)
+                    out->resize(out->size() * 2);
+                }
+                ssize_t n = read(fd, &(*out)[done], out->size() - done);
+                if (n < 0)
+                {
+                    if (errno == EINTR)
+                    {
+                        continue;
+                    }
+                    std::cerr << "read file " << file_path << " failed!" << std::endl;
+                    close(fd);
+                    out->clear();
+                    return false;
+                }
+                if (n == 0)
+                {
+                    break;
+                }
+                done += n;
+            }
+            close(fd);
+            out->resize(done);
             return true;
         }
+
+        //文件的inode、大小和修改时间，rename替换或者原地修改都会改变
+        struct FileStamp
+        {
+            ino_t inode;
+            off_t size;
+            time_t mtime;
+            long mtime_nsec;//同一秒内的多次修改靠纳秒区分
+
+            FileStamp()
+                :inode(0), size(0), mtime(0), mtime_nsec(0)
+            {}
+            bool operator==(const FileStamp& other) const
+            {
+                return inode == other.inode && size == other.size && mtime == other.mtime && mtime_nsec == other.mtime_nsec;
+            }
+        };
+
+        static bool GetFileStamp(const std::string& file_path, FileStamp* stamp)
+        {
+            struct stat st;
+            if(stat(file_path.c_str(), &st) != 0)
+            {
+                return false;
+            }
+            stamp->inode = st.st_ino;
+            stamp->size = st.st_size;
+            stamp->mtime = st.st_mtim.tv_sec;
+            stamp->mtime_nsec = st.st_mtim.tv_nsec;
+            return true;
+        }
+    };
+
+    //限速器：按照每秒rate个单位的速度发放额度，超出时Acquire睡眠等待，用于限制后台任务占用的资源
+    //多个线程共用一个限速器时总速度不超过rate
+    class RateLimiter
+    {
+    private:
+        std::mutex mtx;
+        double rate;
+        std::chrono::steady_clock::time_point next;//下一次可以无等待获取额度的时间
+    public:
+        explicit RateLimiter(double per_second)
+            :rate(per_second), next(std::chrono::steady_clock::now())
+        {}
+
+        void Acquire(uint64_t amount)
+        {
+            std::chrono::steady_clock::duration wait(0);
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+                if(next < now)
+                {
+                    next = now;
+                }
+                wait = next - now;
+                next += std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                            std::chrono::duration<double>(amount / rate));
+            }
+            if(wait.count() > 0)
+            {
+                std::this_thread::sleep_for(wait);
+            }
+        }
+    };
+
+    //只读内存映射文件，多个进程映射同一个文件时共享page cache
+    class MmapFile
+    {
+    private:
+        const char* data_;
+        size_t size_;
+    public:
+        MmapFile()
+            :data_(nullptr), size_(0)
+        {}
+        ~MmapFile()
+        {
+            Close();
+        }
+        MmapFile(const MmapFile&) = delete;
+        MmapFile& operator=(const MmapFile&) = delete;
+
+        bool Open(const std::string& file_path)
+        {
+            Close();
+            int fd = open(file_path.c_str(), O_RDONLY);
+            if(fd < 0)
+            {
+                std::cerr << "open file " << file_path << " failed!" << std::endl;
+                return false;
+            }
+            struct stat st;
+            if(fstat(fd, &st) < 0 || st.st_size == 0)
+            {
+                std::cerr << "stat file " << file_path << " failed!" << std::endl;
+                close(fd);
+                return false;
+            }
+            void* addr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            close(fd);//映射建立之后即可关闭fd
+            if(addr == MAP_FAILED)
+            {
+                std::cerr << "mmap file " << file_path << " failed!" << std::endl;
+                return false;
+            }
+            data_ = static_cast<const char*>(addr);
+            size_ = st.st_size;
+            return true;
+        }
+
+        void Close()
+        {
+            if(data_ != nullptr)
+            {
+                munmap(const_cast<char*>(data_), size_);
+                data_ = nullptr;
+                size_ = 0;
+            }
+        }
+
+        void Swap(MmapFile& other)
+        {
+            std::swap(data_, other.data_);
+            std::swap(size_, other.size_);
+        }
+
+        const char* Data() const { return data_; }
+        size_t Size() const { return size_; }
     };
 
     class StringUtil
@@ -42,39 +217,290 @@ namespace ns_util
         }
     };
 
+    //varint编码：每字节低7位保存数据，最高位表示后面还有字节
+    class VarintUtil
+    {
+    public:
+        static void Encode(uint32_t value, std::string* out)
+        {
+            while(value >= 0x80)
+            {
+                out->push_back(static_cast<char>((value & 0x7f) | 0x80));
+                value >>= 7;
+            }
+            out->push_back(static_cast<char>(value));
+        }
+
+        static uint32_t Decode(const uint8_t** p)
+        {
+            const uint8_t* cur = *p;
+            uint32_t value = *cur & 0x7f;
+            int shift = 7;
+            while(*cur++ & 0x80)
+            {
+                value |= static_cast<uint32_t>(*cur & 0x7f) << shift;
+                shift += 7;
+            }
+            *p = cur;
+            return value;
+        }
+
+        //带边界检查的解码，用于校验不可信的数据：不会读到end之后，超过5字节或者超出uint32_t范围时返回false
+        static bool DecodeChecked(const uint8_t** p, const uint8_t* end, uint32_t* value)
+        {
+            const uint8_t* cur = *p;
+            uint64_t result = 0;
+            for(int shift = 0; shift < 35; shift += 7)
+            {
+                if(cur == end)
+                {
+                    return false;
+                }
+                uint8_t byte = *cur++;
+                result |= static_cast<uint64_t>(byte & 0x7f) << shift;
+                if(!(byte & 0x80))
+                {
+                    if(result > UINT32_MAX)
+                    {
+                        return false;
+                    }
+                    *value = static_cast<uint32_t>(result);
+                    *p = cur;
+                    return true;
+                }
+            }
+            return false;
+        }
+    };
+
+    class HashUtil
+    {
+    public:
+        //FNV-1a，词典和停用词表共用
+        static uint64_t Fnv1a(boost::string_view word)
+        {
+            uint64_t hash = 14695981039346656037ULL;
+            for(char c : word)
+            {
+                hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211ULL;
+            }
+            return hash;
+        }
+
+        //xxHash64：每次处理32字节，比逐字节的FNV-1a快得多，用于整个文件内容的校验
+        static uint64_t XxHash64(const char* data, size_t len, uint64_t seed = 0)
+        {
+            const uint64_t P1 = 11400714785074694791ULL;
+            const uint64_t P2 = 14029467366897019727ULL;
+            const uint64_t P3 = 1609587929392839161ULL;
+            const uint64_t P4 = 9650029242287828579ULL;
+            const uint64_t P5 = 2870177450012600261ULL;
+            const char* p = data;
+            const char* end = data + len;
+            uint64_t hash;
+            if(len >= 32)
+            {
+                uint64_t v1 = seed + P1 + P2;
+                uint64_t v2 = seed + P2;
+                uint64_t v3 = seed;
+                uint64_t v4 = seed - P1;
+                for(; end - p >= 32; p += 32)
+                {
+                    v1 = XxRound(v1, Read64(p));
+                    v2 = XxRound(v2, Read64(p + 8));
+                    v3 = XxRound(v3, Read64(p + 16));
+                    v4 = XxRound(v4, Read64(p + 24));
+                }
+                hash = Rotl(v1, 1) + Rotl(v2, 7) + Rotl(v3, 12) + Rotl(v4, 18);
+                hash = (hash ^ XxRound(0, v1)) * P1 + P4;
+                hash = (hash ^ XxRound(0, v2)) * P1 + P4;
+                hash = (hash ^ XxRound(0, v3)) * P1 + P4;
+                hash = (hash ^ XxRound(0, v4)) * P1 + P4;
+            }
+            else
+            {
+                hash = seed + P5;
+            }
+            hash += len;
+            for(; end - p >= 8; p += 8)
+            {
+                hash = Rotl(hash ^ XxRound(0, Read64(p)), 27) * P1 + P4;
+            }
+            if(end - p >= 4)
+            {
+                uint32_t word;
+                memcpy(&word, p, sizeof(word));
+                hash = Rotl(hash ^ (word * P1), 23) * P2 + P3;
+                p += 4;
+            }
+            for(; p < end; ++p)
+            {
+                hash = Rotl(hash ^ (static_cast<unsigned char>(*p) * P5), 11) * P1;
+            }
+            hash ^= hash >> 33;
+            hash *= P2;
+            hash ^= hash >> 29;
+            hash *= P3;
+            hash ^= hash >> 32;
+            return hash;
+        }
+    private:
+        static uint64_t Rotl(uint64_t x, int r)
+        {
+            return (x << r) | (x >> (64 - r));
+        }
+
+        //按小端读取8个字节
+        static uint64_t Read64(const char* p)
+        {
+            uint64_t value;
+            memcpy(&value, p, sizeof(value));
+            return value;
+        }
+
+        static uint64_t XxRound(uint64_t acc, uint64_t input)
+        {
+            return Rotl(acc + input * 14029467366897019727ULL, 31) * 11400714785074694791ULL;
+        }
+    };
+
     const char *const DICT_PATH = "./dict/jieba.dict.utf8";
     const char *const HMM_PATH = "./dict/hmm_model.utf8";
     const char *const USER_DICT_PATH = "./dict/user.dict.utf8";
     const char *const IDF_PATH = "./dict/idf.utf8";
     const char *const STOP_WORD_PATH = "./dict/stop_words.utf8";
 
-    class JiebaUtil
+    //停用词表：开放寻址(线性探测)的哈希集合，初始化之后只读
+    //直接用string_view查找，分词结果不需要先构造成std::string
+    class StopWordSet
     {
     private:
-        cppjieba::Jieba jieba;
-        std::unordered_set<std::string> stop_words;
+        struct Slot
+        {
+            uint64_t hash;
+            std::string word;//为空表示空位
+        };
+        std::vector<Slot> slots;//大小为2的幂，装载率不超过一半
+        size_t mask;
+        size_t size;
+    public:
+        StopWordSet()
+            :mask(0), size(0)
+        {}
+
+        void Insert(const std::string& word)
+        {
+            if(word.empty() || Contains(word))
+            {
+                return;
+            }
+            if((size + 1) * 2 > slots.size())
+            {
+                Rehash(slots.empty() ? 64 : slots.size() * 2);
+            }
+            Place(Hash(word), word);
+            ++size;
+        }
+
+        bool Contains(boost::string_view word) const
+        {
+            if(slots.empty())
+            {
+                return false;
+            }
+            const uint64_t hash = Hash(word);
+            for(size_t i = hash & mask; !slots[i].word.empty(); i = (i + 1) & mask)
+            {
+                if(slots[i].hash == hash && slots[i].word == word)
+                {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        size_t Size() const { return size; }
     private:
-        static JiebaUtil* instance;
-        static std::mutex mtx;
+        static uint64_t Hash(boost::string_view word)
+        {
+            return HashUtil::Fnv1a(word);
+        }
+
+        void Place(uint64_t hash, const std::string& word)
+        {
+            size_t i = hash & mask;
+            while(!slots[i].word.empty())
+            {
+                i = (i + 1) & mask;
+            }
+            slots[i].hash = hash;
+            slots[i].word = word;
+        }
 
-        static JiebaUtil* GetInstance()
+        void Rehash(size_t capacity)
         {
-            if(instance == nullptr)
+            std::vector<Slot> old(capacity);
+            old.swap(slots);
+            mask = capacity - 1;
+            for(const Slot& slot : old)
             {
-                mtx.lock();
-                if(instance == nullptr)
+                if(!slot.word.empty())
                 {
-                    instance = new JiebaUtil();
-                    instance->InitJiebaUtil();
+                    Place(slot.hash, slot.word);
                 }
-                mtx.unlock();
             }
+        }
+    };
+
+    class JiebaUtil
+    {
+    private:
+        //查询分词结果的缓存，按原始查询串分片，每片是一个LRU
+        static const size_t QUERY_CACHE_SHARDS = 16;
+        static const size_t QUERY_CACHE_SHARD_SIZE = 256;//每片最多缓存的查询数
+        static const size_t QUERY_CACHE_MAX_LENGTH = 256;//更长的查询不缓存
+
+        typedef std::list<std::pair<std::string, std::vector<std::string> > > QueryList;
+        struct QueryCacheShard
+        {
+            std::mutex mtx;
+            QueryList lru;//表头是最近访问的
+            std::unordered_map<std::string, QueryList::iterator> table;
+        };
+
+        cppjieba::Jieba jieba;
+        //与jieba.CutForSearch相同的切分，直接使用它得到每个词在原文中的位置
+        cppjieba::QuerySegment query_segment;
+        std::unordered_set<cppjieba::Rune> separators;//与cppjieba默认的分隔符相同
+        StopWordSet stop_words;
+        mutable QueryCacheShard query_cache[QUERY_CACHE_SHARDS];
+    private:
+        static JiebaUtil* instance;
+        static std::once_flag once;
+
+        //call_once保证只初始化一次，并且其他线程拿到的实例一定是初始化完成的
+        static const JiebaUtil* GetInstance()
+        {
+            std::call_once(once, []()
+            {
+                JiebaUtil* jieba_util = new JiebaUtil();
+                jieba_util->InitJiebaUtil();
+                instance = jieba_util;
+            });
             return instance;
-        } 
+        }
 
         JiebaUtil()
-            :jieba(DICT_PATH, HMM_PATH, USER_DICT_PATH, IDF_PATH, STOP_WORD_PATH)
-        {}
+            :jieba(DICT_PATH, HMM_PATH, USER_DICT_PATH, IDF_PATH, STOP_WORD_PATH),
+             query_segment(jieba.GetDictTrie(), jieba.GetHMMModel())
+        {
+            cppjieba::RuneStrArray runes;
+            cppjieba::DecodeRunesInString(cppjieba::SPECIAL_SEPARATORS, runes);
+            for(const cppjieba::RuneStr& rune : runes)
+            {
+                separators.insert(rune.rune);
+            }
+        }
 
         JiebaUtil(const JiebaUtil&) = delete;
         JiebaUtil operator=(const JiebaUtil&) = delete;
@@ -91,35 +517,119 @@ namespace ns_util
             std::string line;
             while(std::getline(in, line))
             {
-                stop_words.insert(line);
+                stop_words.Insert(line);
             }
             in.close();
         }
 
-        void WordSegmentationHelper(const std::string& src, std::vector<std::string>* out)
+        //初始化之后只读，多个线程可以同时分词
+        //与jieba.CutForSearch的结果相同，只是停用词在切分时就跳过；结果直接指向src，不拷贝
+        void WordSegmentationHelper(const std::string& src, std::vector<boost::string_view>* out) const
         {
-            jieba.CutForSearch(src, *out);
-            for(auto iter = out->begin(); iter != out->end();)
+            out->clear();
+            cppjieba::PreFilter pre_filter(separators, src);
+            std::vector<cppjieba::WordRange> ranges;
+            while(pre_filter.HasNext())
             {
-                if(stop_words.find(*iter) != stop_words.end())
-                {
-                    iter = out->erase(iter);
-                }
-                else
+                //每一段的WordRange指向pre_filter内部的解码结果，在这一段内转换成原文的位置
+                cppjieba::PreFilter::Range range = pre_filter.Next();
+                ranges.clear();
+                query_segment.Cut(range.begin, range.end, ranges, true);
+                for(const cppjieba::WordRange& word : ranges)
                 {
-                    ++iter;
+                    uint32_t offset = word.left->offset;
+                    uint32_t length = word.right->offset - offset + word.right->len;
+                    boost::string_view token(src.data() + offset, length);
+                    if(!stop_words.Contains(token))
+                    {
+                        out->push_back(token);
+                    }
                 }
             }
         }
+
+        void WordSegmentationHelper(const std::string& src, std::vector<std::string>* out) const
+        {
+            std::vector<boost::string_view> tokens;
+            WordSegmentationHelper(src, &tokens);
+            out->clear();
+            out->reserve(tokens.size());
+            for(boost::string_view token : tokens)
+            {
+                out->emplace_back(token.data(), token.size());
+            }
+        }
+
+        bool LookupQuery(const std::string& query, std::vector<std::string>* out) const
+        {
+            QueryCacheShard& shard = query_cache[std::hash<std::string>()(query) % QUERY_CACHE_SHARDS];
+            std::lock_guard<std::mutex> lock(shard.mtx);
+            auto iter = shard.table.find(query);
+            if(iter == shard.table.end())
+            {
+                return false;
+            }
+            shard.lru.splice(shard.lru.begin(), shard.lru, iter->second);
+            *out = iter->second->second;
+            return true;
+        }
+
+        void StoreQuery(const std::string& query, const std::vector<std::string>& words) const
+        {
+            QueryCacheShard& shard = query_cache[std::hash<std::string>()(query) % QUERY_CACHE_SHARDS];
+            std::lock_guard<std::mutex> lock(shard.mtx);
+            if(shard.table.find(query) != shard.table.end())
+            {
+                return;//其他线程已经放入
+            }
+            shard.lru.emplace_front(query, words);
+            shard.table[query] = shard.lru.begin();
+            if(shard.lru.size() > QUERY_CACHE_SHARD_SIZE)
+            {
+                shard.table.erase(shard.lru.back().first);
+                shard.lru.pop_back();
+            }
+        }
+
+        void QuerySegmentationHelper(const std::string& query, std::vector<std::string>* out) const
+        {
+            const bool cacheable = query.size() <= QUERY_CACHE_MAX_LENGTH;
+            if(cacheable && LookupQuery(query, out))
+            {
+                return;
+            }
+            out->clear();
+            WordSegmentationHelper(query, out);
+            for(std::string& word : *out)
+            {
+                boost::to_lower(word);
+            }
+            if(cacheable)
+            {
+                StoreQuery(query, *out);
+            }
+        }
     public:
         static void WordSegmentation(const std::string& src, std::vector<std::string>* out)
         {
             JiebaUtil::GetInstance()->WordSegmentationHelper(src, out);
             //jieba.CutForSearch(src, *out);
         }
+
+        //分词结果直接指向src中的位置，不为每个词分配内存，src在使用结果期间必须保持不变
+        static void WordSegmentation(const std::string& src, std::vector<boost::string_view>* out)
+        {
+            JiebaUtil::GetInstance()->WordSegmentationHelper(src, out);
+        }
+
+        //查询分词：分词、去掉停用词并转为小写，相同的查询直接使用缓存的结果
+        static void QuerySegmentation(const std::string& query, std::vector<std::string>* out)
+        {
+            JiebaUtil::GetInstance()->QuerySegmentationHelper(query, out);
+        }
     };
     JiebaUtil* JiebaUtil::instance = nullptr;
-    std::mutex JiebaUtil::mtx;
+    std::once_flag JiebaUtil::once;
     
     // class JiebaUtil
     // {